@@ -0,0 +1,132 @@
+// Reads 4:2:0 frames with 4-byte aligned rows through the stdio backend and prints the I/O statistics of the stream,
+// next to the calls that reading row by row (one read and one skip per row) takes.
+//
+// Usage: rawzbench [path] [frames]
+// The file is created at path (default /dev/shm/rawzbench.raw) and removed afterwards. Use a tmpfs path, so that the
+// call overhead is not hidden by the device.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include "rawz.h"
+
+namespace {
+
+constexpr unsigned width = 1918;
+constexpr unsigned height = 1080;
+constexpr unsigned alignment = 2;
+
+struct StreamDeleter {
+	void operator()(rawz_video_stream *ptr) { rawz_video_stream_free(ptr); }
+};
+
+size_t aligned_row(unsigned w) { return (w + (1U << alignment) - 1) & ~((1U << alignment) - 1); }
+
+rawz_format bench_format()
+{
+	rawz_format format;
+	rawz_format_default(&format);
+	format.mode = RAWZ_PLANAR;
+	format.width = width;
+	format.height = height;
+	format.planes_mask = 7;
+	format.subsample_w = 1;
+	format.subsample_h = 1;
+	format.bytes_per_sample = 1;
+	format.bits_per_sample = 8;
+	format.alignment = alignment;
+	return format;
+}
+
+size_t frame_size()
+{
+	return aligned_row(width) * height + 2 * aligned_row(width / 2) * (height / 2);
+}
+
+bool write_file(const char *path, unsigned frames)
+{
+	std::vector<unsigned char> frame(frame_size());
+	FILE *file = std::fopen(path, "wb");
+
+	if (!file)
+		return false;
+
+	for (size_t i = 0; i < frame.size(); ++i) {
+		frame[i] = static_cast<unsigned char>(i * 7);
+	}
+	for (unsigned n = 0; n < frames; ++n) {
+		if (std::fwrite(frame.data(), 1, frame.size(), file) != frame.size()) {
+			std::fclose(file);
+			return false;
+		}
+	}
+
+	return !std::fclose(file);
+}
+
+// Reads every frame into planes with the given strides.
+bool run(const char *label, const char *path, unsigned frames, ptrdiff_t luma_stride, ptrdiff_t chroma_stride)
+{
+	rawz_format format = bench_format();
+	std::unique_ptr<rawz_video_stream, StreamDeleter> stream{ rawz_video_stream_create(rawz_io_open_file(path, 1, 0), &format) };
+	rawz_stream_stats before;
+	rawz_stream_stats after;
+
+	if (!stream) {
+		std::fprintf(stderr, "%s\n", rawz_get_last_error());
+		return false;
+	}
+
+	std::vector<unsigned char> luma(luma_stride * height);
+	std::vector<unsigned char> chroma(2 * chroma_stride * (height / 2));
+	void * const planes[4] = { luma.data(), chroma.data(), chroma.data() + chroma_stride * (height / 2), nullptr };
+	const ptrdiff_t stride[4] = { luma_stride, chroma_stride, chroma_stride, 0 };
+
+	rawz_video_stream_stats(stream.get(), &before);
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned n = 0; n < frames; ++n) {
+		if (rawz_video_stream_read(stream.get(), n, planes, stride)) {
+			std::fprintf(stderr, "frame %u: %s\n", n, rawz_get_last_error());
+			return false;
+		}
+	}
+
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	rawz_video_stream_stats(stream.get(), &after);
+
+	std::printf("%s (stride %td/%td)\n", label, luma_stride, chroma_stride);
+	std::printf("  before: read_requests %llu, read_calls %llu\n",
+	            static_cast<unsigned long long>(before.read_requests), static_cast<unsigned long long>(before.read_calls));
+	std::printf("  after:  read_requests %llu, read_calls %llu\n",
+	            static_cast<unsigned long long>(after.read_requests), static_cast<unsigned long long>(after.read_calls));
+	std::printf("  %.1f calls per frame, %.3f ms per frame\n",
+	            static_cast<double>(after.read_calls - before.read_calls) / frames, elapsed * 1000 / frames);
+	return true;
+}
+
+} // namespace
+
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : "/dev/shm/rawzbench.raw";
+	unsigned frames = argc > 2 ? static_cast<unsigned>(std::strtoul(argv[2], nullptr, 10)) : 200;
+
+	if (!frames || !write_file(path, frames)) {
+		std::fprintf(stderr, "cannot write %s\n", path);
+		return 1;
+	}
+
+	std::printf("%ux%u 4:2:0, rows aligned to %u bytes, %u frames\n", width, height, 1U << alignment, frames);
+	std::printf("row by row: %u calls per frame\n", 2 * (height + height / 2 * 2));
+
+	bool ok = run("whole planes", path, frames, aligned_row(width), aligned_row(width / 2)) &&
+	          run("scattered rows", path, frames, 2048, 1024);
+
+	std::remove(path);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,275 @@
+// Reference producer for shared memory ring buffers (rawz_shm_producer_*).
+//
+// Usage: rawzshm
+//          Publishes frames from a thread and reads them back through rawz_io_open_shm. Checks that waiting readers
+//          receive every frame intact, that frames which have left the ring are rejected, and that frames overwritten
+//          while being copied are rejected rather than returned torn.
+//        rawzshm produce <name> [frames] [fps]
+//          Publishes Gray8 frames of 1024x1024 to a ring buffer of 8 slots for an external reader, e.g.
+//          core.rawz.Source("shm:<name>", 1024, 1024, vs.GRAY8, framecount=frames). Every byte of frame n has the
+//          value n * 7 + 1 modulo 256.
+// Linux only.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "rawz.h"
+
+namespace {
+
+constexpr unsigned width = 1024;
+constexpr unsigned height = 1024;
+constexpr size_t frame_size = static_cast<size_t>(width) * height;
+constexpr unsigned slot_count = 8;
+
+struct ProducerDeleter {
+	void operator()(rawz_shm_producer *ptr) { rawz_shm_producer_free(ptr); }
+};
+
+struct StreamDeleter {
+	void operator()(rawz_video_stream *ptr) { rawz_video_stream_free(ptr); }
+};
+
+using Producer = std::unique_ptr<rawz_shm_producer, ProducerDeleter>;
+using Stream = std::unique_ptr<rawz_video_stream, StreamDeleter>;
+
+unsigned char frame_value(uint64_t n) { return static_cast<unsigned char>(n * 7 + 1); }
+
+void publish(rawz_shm_producer *producer, uint64_t n)
+{
+	std::memset(rawz_shm_producer_slot(producer), frame_value(n), frame_size);
+	rawz_shm_producer_publish(producer);
+}
+
+Stream open_reader(const char *name, int64_t framecount)
+{
+	rawz_format format;
+	rawz_format_default(&format);
+	format.mode = RAWZ_PLANAR;
+	format.width = width;
+	format.height = height;
+	format.planes_mask = 1;
+	format.bytes_per_sample = 1;
+	format.bits_per_sample = 8;
+
+	rawz_io_options io_options;
+	rawz_io_options_default(&io_options);
+	io_options.follow_timeout = 5000;
+
+	rawz_stream_options stream_options;
+	rawz_stream_options_default(&stream_options);
+	stream_options.framecount = framecount;
+
+	Stream stream{ rawz_video_stream_create2(rawz_io_open_shm(name, &io_options), &format, &stream_options) };
+	if (!stream)
+		std::fprintf(stderr, "open: %s\n", rawz_get_last_error());
+	return stream;
+}
+
+enum class Result {
+	ok,
+	torn,
+	lost,
+	overwritten,
+	error,
+};
+
+Result read_frame(rawz_video_stream *stream, int64_t n, std::vector<unsigned char> &buf)
+{
+	void * const planes[4] = { buf.data() };
+	const ptrdiff_t stride[4] = { width };
+
+	if (rawz_video_stream_read(stream, n, planes, stride)) {
+		std::string error = rawz_get_last_error();
+		if (error.find("no longer in ring buffer") != std::string::npos)
+			return Result::lost;
+		if (error.find("overwritten during read") != std::string::npos)
+			return Result::overwritten;
+		std::fprintf(stderr, "frame %lld: %s\n", static_cast<long long>(n), error.c_str());
+		return Result::error;
+	}
+
+	for (unsigned char c : buf) {
+		if (c != frame_value(n))
+			return Result::torn;
+	}
+	return Result::ok;
+}
+
+// The reader runs ahead of a slow producer, so that it waits for every frame. The producer never laps the reader.
+bool check_consume(const char *name)
+{
+	constexpr unsigned frames = 64;
+	Producer producer{ rawz_shm_producer_create(name, frame_size, slot_count) };
+	if (!producer) {
+		std::fprintf(stderr, "create: %s\n", rawz_get_last_error());
+		return false;
+	}
+
+	Stream stream = open_reader(name, frames);
+	if (!stream)
+		return false;
+
+	std::atomic<unsigned> consumed{ 0 };
+
+	std::thread thread{ [&]() {
+		for (unsigned n = 0; n < frames; ++n) {
+			std::this_thread::sleep_for(std::chrono::milliseconds{ 2 });
+			while (n >= consumed + slot_count - 1) {
+				std::this_thread::yield();
+			}
+			publish(producer.get(), n);
+		}
+	} };
+
+	std::vector<unsigned char> buf(frame_size);
+	unsigned ok = 0;
+
+	for (unsigned n = 0; n < frames; ++n) {
+		ok += read_frame(stream.get(), n, buf) == Result::ok;
+		++consumed;
+	}
+	thread.join();
+
+	std::printf("consume: %u of %u frames intact\n", ok, frames);
+	return ok == frames;
+}
+
+// Frames older than the ring must be rejected.
+bool check_lost(const char *name)
+{
+	Producer producer{ rawz_shm_producer_create(name, frame_size, slot_count) };
+	if (!producer) {
+		std::fprintf(stderr, "create: %s\n", rawz_get_last_error());
+		return false;
+	}
+
+	Stream stream = open_reader(name, slot_count * 2);
+	if (!stream)
+		return false;
+
+	for (unsigned n = 0; n < slot_count + 1; ++n) {
+		publish(producer.get(), n);
+	}
+
+	std::vector<unsigned char> buf(frame_size);
+	Result first = read_frame(stream.get(), 0, buf);
+	Result last = read_frame(stream.get(), slot_count, buf);
+
+	std::printf("lost: frame 0 %s, frame %u %s\n", first == Result::lost ? "rejected" : "not rejected", slot_count,
+	            last == Result::ok ? "intact" : "not intact");
+	return first == Result::lost && last == Result::ok;
+}
+
+// The reader copies the oldest frame while the producer publishes as fast as it can. Every frame is either intact or
+// rejected.
+bool check_overwrite(const char *name)
+{
+	constexpr auto duration = std::chrono::seconds{ 1 };
+	constexpr int64_t max_frames = INT64_MAX / frame_size;
+
+	Producer producer{ rawz_shm_producer_create(name, frame_size, slot_count) };
+	if (!producer) {
+		std::fprintf(stderr, "create: %s\n", rawz_get_last_error());
+		return false;
+	}
+
+	Stream stream = open_reader(name, max_frames);
+	if (!stream)
+		return false;
+
+	std::atomic<uint64_t> published{ 0 };
+	std::atomic<bool> done{ false };
+
+	std::thread thread{ [&]() {
+		while (!done) {
+			uint64_t n = published.load();
+			publish(producer.get(), n);
+			published.store(n + 1);
+		}
+	} };
+
+	std::vector<unsigned char> buf(frame_size);
+	unsigned counts[5] = {};
+	auto deadline = std::chrono::steady_clock::now() + duration;
+
+	while (std::chrono::steady_clock::now() < deadline) {
+		uint64_t count = published.load();
+		if (count < slot_count)
+			continue;
+
+		++counts[static_cast<int>(read_frame(stream.get(), count - slot_count + 1, buf))];
+	}
+	done = true;
+	thread.join();
+
+	std::printf("overwrite: %u intact, %u rejected before copy, %u rejected after copy, %u torn, %u errors\n",
+	            counts[static_cast<int>(Result::ok)], counts[static_cast<int>(Result::lost)],
+	            counts[static_cast<int>(Result::overwritten)], counts[static_cast<int>(Result::torn)],
+	            counts[static_cast<int>(Result::error)]);
+	return !counts[static_cast<int>(Result::torn)] && !counts[static_cast<int>(Result::error)];
+}
+
+int check()
+{
+	std::string name = "/rawzshm-" + std::to_string(getpid());
+	bool ok = true;
+
+	for (bool (*func)(const char *) : { check_consume, check_lost, check_overwrite }) {
+		ok = func(name.c_str()) && ok;
+		shm_unlink(name.c_str());
+	}
+
+	std::puts(ok ? "passed" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+int produce(const char *name, uint64_t frames, unsigned fps)
+{
+	Producer producer{ rawz_shm_producer_create(name, frame_size, slot_count) };
+	if (!producer) {
+		std::fprintf(stderr, "create: %s\n", rawz_get_last_error());
+		return 1;
+	}
+
+	auto next = std::chrono::steady_clock::now();
+
+	for (uint64_t n = 0; n < frames; ++n) {
+		publish(producer.get(), n);
+
+		if (fps) {
+			next += std::chrono::microseconds{ 1000000 / fps };
+			std::this_thread::sleep_until(next);
+		}
+	}
+
+	std::printf("published %llu frames to %s\n", static_cast<unsigned long long>(frames), name);
+	return 0;
+}
+
+} // namespace
+
+
+int main(int argc, char **argv)
+{
+	if (argc > 2 && !std::strcmp(argv[1], "produce")) {
+		uint64_t frames = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 1000;
+		unsigned fps = argc > 4 ? static_cast<unsigned>(std::strtoul(argv[4], nullptr, 10)) : 60;
+		return produce(argv[2], frames, fps);
+	}
+	if (argc > 1) {
+		std::fprintf(stderr, "usage: rawzshm [produce <name> [frames] [fps]]\n");
+		return 1;
+	}
+
+	return check();
+}
@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include "io.h"
+#include "stream.h"
+
+namespace rawz {
+
+namespace {
+
+// Larger than the largest folio that is likely to be in the page cache (PMD size on common architectures).
+constexpr uint64_t drop_overlap = 4UL << 20;
+
+// Issues page cache advice around each frame read.
+class AdvisedVideoStream : public VideoStream {
+	std::unique_ptr<VideoStream> m_stream;
+	IOStream *m_io;
+	int64_t m_willneed_depth;
+	bool m_drop_behind;
+
+	std::mutex m_mutex;
+	int64_t m_last;
+	uint64_t m_drop_begin;
+	uint64_t m_willneed_end;
+
+	void advise_ahead(int64_t n, uint64_t end)
+	{
+		int64_t last = std::min(n + m_willneed_depth, m_stream->framecount() - 1);
+		if (last <= n)
+			return;
+
+		uint64_t ahead_end = m_stream->packet_offset(last) + m_stream->packet_size();
+		uint64_t ahead_begin = end;
+
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+
+			// Sequential access only needs advice for the frames entering the window.
+			if (n == m_last + 1 && m_willneed_end > ahead_begin)
+				ahead_begin = m_willneed_end;
+
+			m_willneed_end = ahead_end;
+		}
+
+		if (ahead_end > ahead_begin)
+			m_io->advise(ahead_begin, ahead_end - ahead_begin, IOStream::Advice::willneed);
+	}
+
+	void drop_behind(int64_t n, uint64_t begin, uint64_t end)
+	{
+		uint64_t drop_begin = begin;
+
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+
+			// The page cache can only evict folios that are entirely within the range, and large folios may
+			// straddle frames. Sequential access therefore repeats the tail of the previous range.
+			if (n == m_last + 1 && m_drop_begin <= begin)
+				drop_begin = m_drop_begin;
+
+			m_drop_begin = std::max(drop_begin, end - std::min(end, drop_overlap));
+		}
+
+		m_io->advise(drop_begin, end - drop_begin, IOStream::Advice::dontneed);
+	}
+
+	void update_last(int64_t n)
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		m_last = n;
+	}
+public:
+	AdvisedVideoStream(std::unique_ptr<VideoStream> stream, IOStream *io, bool drop_behind, unsigned willneed_depth) :
+		m_stream{ std::move(stream) },
+		m_io{ io },
+		m_willneed_depth{ willneed_depth },
+		m_drop_behind{ drop_behind },
+		m_last{ -1 },
+		m_drop_begin{},
+		m_willneed_end{}
+	{}
+
+	int64_t framecount() const noexcept override { return m_stream->framecount(); }
+
+	rawz_metadata metadata() const noexcept override { return m_stream->metadata(); }
+
+	rawz_stream_stats stats() const noexcept override { return m_stream->stats(); }
+
+	uint64_t packet_offset(int64_t n) const override { return m_stream->packet_offset(n); }
+
+	uint64_t packet_size() const noexcept override { return m_stream->packet_size(); }
+
+	void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4], rawz_frame_info *info) override
+	{
+		uint64_t begin = m_stream->packet_offset(n);
+		uint64_t end = begin + m_stream->packet_size();
+
+		if (m_willneed_depth)
+			advise_ahead(n, end);
+
+		m_stream->read(n, planes, stride, info);
+
+		if (m_drop_behind)
+			drop_behind(n, begin, end);
+
+		update_last(n);
+	}
+
+	// Mapped frames are still in use after returning, so they are never dropped.
+	bool map(int64_t n, const void *planes[4], ptrdiff_t stride[4]) override
+	{
+		if (!m_stream->map(n, planes, stride))
+			return false;
+
+		if (m_willneed_depth)
+			advise_ahead(n, m_stream->packet_offset(n) + m_stream->packet_size());
+
+		update_last(n);
+		return true;
+	}
+};
+
+} // namespace
+
+
+std::unique_ptr<VideoStream> create_advised_stream(std::unique_ptr<VideoStream> stream, IOStream *io, bool drop_behind, unsigned willneed_depth)
+{
+	return std::make_unique<AdvisedVideoStream>(std::move(stream), io, drop_behind, willneed_depth);
+}
+
+} // namespace rawz
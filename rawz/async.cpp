@@ -0,0 +1,689 @@
+#ifdef __GNUC__
+  #define _FILE_OFFSET_BITS 64
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "io.h"
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/stat.h>
+  #include <sys/types.h>
+  #include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+  #if __has_include(<linux/io_uring.h>)
+    #define RAWZ_HAVE_IO_URING
+    #include <atomic>
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <sys/uio.h>
+  #endif
+#endif
+
+
+namespace rawz {
+
+#ifndef _WIN32
+namespace {
+
+// Large requests are split to keep multiple reads in flight.
+constexpr size_t max_request_size = 1UL << 20;
+constexpr unsigned default_queue_depth = 64;
+constexpr unsigned max_queue_depth = 4096;
+constexpr unsigned max_fixed_buffers = 16;
+constexpr unsigned default_threads = 4;
+constexpr unsigned max_threads = 64;
+
+
+struct ReadOp {
+	uint64_t offset;
+	unsigned char *buf;
+	size_t n;
+};
+
+void split_requests(const IORequest *req, size_t count, uint64_t base_offset, std::vector<ReadOp> &ops)
+{
+	for (size_t i = 0; i < count; ++i) {
+		uint64_t offset = req[i].offset;
+		unsigned char *buf = static_cast<unsigned char *>(req[i].buf);
+		size_t n = req[i].n;
+
+		if (offset > static_cast<uint64_t>(INT64_MAX) - base_offset || n > static_cast<uint64_t>(INT64_MAX) - base_offset - offset)
+			throw IOStream::eof{};
+
+		while (n) {
+			size_t cur = std::min(n, max_request_size);
+			ops.push_back({ base_offset + offset, buf, cur });
+			offset += cur;
+			buf += cur;
+			n -= cur;
+		}
+	}
+}
+
+class ReadEngine {
+public:
+	virtual ~ReadEngine() = default;
+
+	// Offsets are absolute. Throws IOStream::eof if any request is truncated.
+	virtual void read(const ReadOp *ops, size_t count) = 0;
+};
+
+
+class ThreadPoolEngine : public ReadEngine {
+	struct Batch {
+		size_t pending;
+		int error;
+		bool eof;
+	};
+
+	struct Job {
+		ReadOp op;
+		Batch *batch;
+	};
+
+	int m_fd;
+	std::deque<Job> m_queue;
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_work_cv;
+	std::condition_variable m_done_cv;
+	bool m_quit;
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			m_quit = true;
+		}
+		m_work_cv.notify_all();
+
+		for (std::thread &th : m_threads) {
+			th.join();
+		}
+		m_threads.clear();
+	}
+
+	void worker()
+	{
+		std::unique_lock<std::mutex> lock{ m_mutex };
+
+		while (true) {
+			m_work_cv.wait(lock, [&]() { return m_quit || !m_queue.empty(); });
+			if (m_quit)
+				break;
+
+			Job job = m_queue.front();
+			m_queue.pop_front();
+			lock.unlock();
+
+			int error = 0;
+			bool eof = false;
+
+			try {
+				eof = pread_full(m_fd, job.op.buf, job.op.n, job.op.offset) != job.op.n;
+			} catch (const std::system_error &e) {
+				error = e.code().value();
+			}
+
+			lock.lock();
+			if (error)
+				job.batch->error = error;
+			if (eof)
+				job.batch->eof = true;
+			if (!--job.batch->pending)
+				m_done_cv.notify_all();
+		}
+	}
+public:
+	ThreadPoolEngine(int fd, unsigned threads) : m_fd{ fd }, m_quit{}
+	{
+		try {
+			for (unsigned i = 0; i < threads; ++i) {
+				m_threads.emplace_back(&ThreadPoolEngine::worker, this);
+			}
+		} catch (...) {
+			stop();
+			throw;
+		}
+	}
+
+	ThreadPoolEngine(const ThreadPoolEngine &) = delete;
+
+	~ThreadPoolEngine() { stop(); }
+
+	ThreadPoolEngine &operator=(const ThreadPoolEngine &) = delete;
+
+	void read(const ReadOp *ops, size_t count) override
+	{
+		if (!count)
+			return;
+
+		Batch batch{ count, 0, false };
+
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			for (size_t i = 0; i < count; ++i) {
+				m_queue.push_back({ ops[i], &batch });
+			}
+		}
+		m_work_cv.notify_all();
+
+		std::unique_lock<std::mutex> lock{ m_mutex };
+		m_done_cv.wait(lock, [&]() { return !batch.pending; });
+
+		if (batch.error)
+			throw_system_error(batch.error);
+		if (batch.eof)
+			throw IOStream::eof{};
+	}
+};
+
+
+#ifdef RAWZ_HAVE_IO_URING
+// Shared by all threads reading from the stream. Each thread queues its requests to the ring, and one thread at a time
+// waits for completions and hands them to the batches they belong to.
+class UringEngine : public ReadEngine {
+	struct Batch {
+		size_t pending;
+		int error;
+		bool eof;
+	};
+
+	struct Ring {
+		void *ptr = MAP_FAILED;
+		size_t size = 0;
+
+		~Ring() { if (ptr != MAP_FAILED) munmap(ptr, size); }
+	};
+
+	struct Slot {
+		ReadOp op;
+		size_t buffer;
+		Batch *batch;
+		iovec iov; // Used by IORING_OP_READV.
+	};
+
+	int m_ring_fd;
+	unsigned m_depth;
+	Ring m_sq_ring;
+	Ring m_cq_ring;
+	Ring m_sqes;
+
+	std::atomic<unsigned> *m_sq_head;
+	std::atomic<unsigned> *m_sq_tail;
+	unsigned m_sq_mask;
+	unsigned *m_sq_array;
+	io_uring_sqe *m_sqe;
+
+	std::atomic<unsigned> *m_cq_head;
+	std::atomic<unsigned> *m_cq_tail;
+	unsigned m_cq_mask;
+	io_uring_cqe *m_cqe;
+
+	// Registered staging buffers. Requests without a free buffer read directly into the destination.
+	std::unique_ptr<unsigned char[]> m_buffers;
+	std::vector<size_t> m_free_buffers;
+
+	// Guarded by m_mutex. The lock is not held while waiting for completions.
+	std::vector<Slot> m_slots;
+	std::vector<size_t> m_free_slots;
+	bool m_have_read; // IORING_OP_READ is supported. Otherwise, IORING_OP_READV is used.
+	unsigned m_to_submit; // Queued in the ring, but not yet submitted.
+	unsigned m_submitted; // Submitted, but not yet completed.
+	bool m_reaping;
+	std::mutex m_mutex;
+	std::condition_variable m_reaped_cv;
+
+	static void *map_ring(Ring &ring, int fd, size_t size, off_t offset)
+	{
+		ring.ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+		if (ring.ptr == MAP_FAILED)
+			throw_system_error();
+		ring.size = size;
+		return ring.ptr;
+	}
+
+	template <class T>
+	static T *ring_ptr(void *base, unsigned offset)
+	{
+		return reinterpret_cast<T *>(static_cast<unsigned char *>(base) + offset);
+	}
+
+	void register_file(int fd)
+	{
+		if (syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_FILES, &fd, 1))
+			throw_system_error();
+	}
+
+	void register_buffers()
+	{
+		unsigned num_buffers = std::min(m_depth, max_fixed_buffers);
+		m_buffers.reset(new unsigned char[static_cast<size_t>(num_buffers) * max_request_size]);
+
+		std::vector<iovec> iov(num_buffers);
+		for (unsigned i = 0; i < num_buffers; ++i) {
+			iov[i].iov_base = m_buffers.get() + static_cast<size_t>(i) * max_request_size;
+			iov[i].iov_len = max_request_size;
+			m_free_buffers.push_back(i);
+		}
+
+		// Fails if the buffers exceed RLIMIT_MEMLOCK. Reads go directly to the destination in that case.
+		if (syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_BUFFERS, iov.data(), num_buffers)) {
+			m_buffers.reset();
+			m_free_buffers.clear();
+		}
+	}
+
+	// Linux 5.1 to 5.5 accept the ring, but fail IORING_OP_READ with EINVAL. The probe was added with the opcode.
+	bool probe_read()
+	{
+#ifdef IO_URING_OP_SUPPORTED
+		constexpr unsigned num_ops = 256;
+		std::vector<uint64_t> storage((sizeof(io_uring_probe) + num_ops * sizeof(io_uring_probe_op) + 7) / 8);
+		io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(storage.data());
+
+		if (syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_PROBE, probe, num_ops))
+			return false;
+		return probe->ops_len > IORING_OP_READ && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+#else
+		return false;
+#endif
+	}
+
+	void push(size_t slot_idx)
+	{
+		Slot &slot = m_slots[slot_idx];
+		unsigned tail = m_sq_tail->load(std::memory_order_relaxed);
+		unsigned idx = tail & m_sq_mask;
+
+		io_uring_sqe *sqe = m_sqe + idx;
+		std::memset(sqe, 0, sizeof(*sqe));
+		sqe->fd = 0;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->off = slot.op.offset;
+		sqe->len = static_cast<unsigned>(slot.op.n);
+		sqe->user_data = slot_idx;
+
+		if (slot.buffer != SIZE_MAX) {
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->addr = reinterpret_cast<uintptr_t>(m_buffers.get() + slot.buffer * max_request_size);
+			sqe->buf_index = static_cast<uint16_t>(slot.buffer);
+		} else if (m_have_read) {
+#ifdef IO_URING_OP_SUPPORTED
+			sqe->opcode = IORING_OP_READ;
+			sqe->addr = reinterpret_cast<uintptr_t>(slot.op.buf);
+#endif
+		} else {
+			slot.iov.iov_base = slot.op.buf;
+			slot.iov.iov_len = slot.op.n;
+			sqe->opcode = IORING_OP_READV;
+			sqe->addr = reinterpret_cast<uintptr_t>(&slot.iov);
+			sqe->len = 1;
+		}
+
+		m_sq_array[idx] = idx;
+		m_sq_tail->store(tail + 1, std::memory_order_release);
+		++m_to_submit;
+	}
+
+	// Submits queued requests, and waits for at least one completion if wait is set. Returns the number submitted.
+	// Called without the lock. Threads submitting concurrently each pass the number of requests they have claimed.
+	unsigned enter(unsigned to_submit, bool wait)
+	{
+		while (true) {
+			long res = syscall(__NR_io_uring_enter, m_ring_fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+			if (res < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+				continue;
+			if (res < 0)
+				throw_system_error();
+
+			return static_cast<unsigned>(res);
+		}
+	}
+
+	// Hands completions to their batches. Requests that must be read again are queued for submission.
+	void reap()
+	{
+		unsigned head = m_cq_head->load(std::memory_order_relaxed);
+		unsigned tail = m_cq_tail->load(std::memory_order_acquire);
+
+		for (; head != tail; ++head) {
+			const io_uring_cqe &cqe = m_cqe[head & m_cq_mask];
+			size_t slot_idx = static_cast<size_t>(cqe.user_data);
+			int res = cqe.res;
+			Slot &slot = m_slots[slot_idx];
+
+			--m_submitted;
+
+			if (res == -EAGAIN || res == -EINTR) {
+				push(slot_idx);
+				continue;
+			}
+
+			if (res > 0 && slot.buffer != SIZE_MAX)
+				std::memcpy(slot.op.buf, m_buffers.get() + slot.buffer * max_request_size, res);
+
+			if (res > 0 && static_cast<size_t>(res) < slot.op.n) {
+				// Short read. Resubmit the remainder.
+				slot.op.offset += res;
+				slot.op.buf += res;
+				slot.op.n -= res;
+				push(slot_idx);
+				continue;
+			}
+
+			if (res < 0)
+				slot.batch->error = -res;
+			else if (res == 0)
+				slot.batch->eof = true;
+
+			--slot.batch->pending;
+			if (slot.buffer != SIZE_MAX)
+				m_free_buffers.push_back(slot.buffer);
+			m_free_slots.push_back(slot_idx);
+		}
+
+		m_cq_head->store(head, std::memory_order_release);
+	}
+public:
+	UringEngine(int fd, unsigned depth, bool fixed_buffers) :
+		m_ring_fd{ -1 },
+		m_depth{},
+		m_sq_head{},
+		m_sq_tail{},
+		m_sq_mask{},
+		m_sq_array{},
+		m_sqe{},
+		m_cq_head{},
+		m_cq_tail{},
+		m_cq_mask{},
+		m_cqe{},
+		m_have_read{},
+		m_to_submit{},
+		m_submitted{},
+		m_reaping{}
+	{
+		static_assert(sizeof(std::atomic<unsigned>) == sizeof(unsigned), "");
+
+		io_uring_params params{};
+		m_ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+		if (m_ring_fd < 0)
+			throw_system_error();
+
+		try {
+			m_depth = std::min(depth, params.sq_entries);
+
+			size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			void *sq = map_ring(m_sq_ring, m_ring_fd, sq_size, IORING_OFF_SQ_RING);
+			void *cq = map_ring(m_cq_ring, m_ring_fd, cq_size, IORING_OFF_CQ_RING);
+			m_sqe = static_cast<io_uring_sqe *>(map_ring(m_sqes, m_ring_fd, params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+
+			m_sq_head = ring_ptr<std::atomic<unsigned>>(sq, params.sq_off.head);
+			m_sq_tail = ring_ptr<std::atomic<unsigned>>(sq, params.sq_off.tail);
+			m_sq_mask = *ring_ptr<unsigned>(sq, params.sq_off.ring_mask);
+			m_sq_array = ring_ptr<unsigned>(sq, params.sq_off.array);
+
+			m_cq_head = ring_ptr<std::atomic<unsigned>>(cq, params.cq_off.head);
+			m_cq_tail = ring_ptr<std::atomic<unsigned>>(cq, params.cq_off.tail);
+			m_cq_mask = *ring_ptr<unsigned>(cq, params.cq_off.ring_mask);
+			m_cqe = ring_ptr<io_uring_cqe>(cq, params.cq_off.cqes);
+
+			register_file(fd);
+			m_have_read = probe_read();
+			if (fixed_buffers)
+				register_buffers();
+
+			m_slots.resize(m_depth);
+			for (unsigned i = 0; i < m_depth; ++i) {
+				m_free_slots.push_back(i);
+			}
+		} catch (...) {
+			close(m_ring_fd);
+			throw;
+		}
+	}
+
+	UringEngine(const UringEngine &) = delete;
+
+	~UringEngine() { close(m_ring_fd); }
+
+	UringEngine &operator=(const UringEngine &) = delete;
+
+	void read(const ReadOp *ops, size_t count) override
+	{
+		Batch batch{ 0, 0, false };
+		size_t next = 0;
+		std::unique_lock<std::mutex> lock{ m_mutex };
+
+		// In-flight requests must complete even on failure, as they refer to caller memory.
+		while (batch.pending || (next < count && !batch.error && !batch.eof)) {
+			while (next < count && !batch.error && !batch.eof && !m_free_slots.empty()) {
+				size_t slot_idx = m_free_slots.back();
+				m_free_slots.pop_back();
+
+				Slot &slot = m_slots[slot_idx];
+				slot.op = ops[next++];
+				slot.buffer = SIZE_MAX;
+				slot.batch = &batch;
+
+				if (!m_free_buffers.empty()) {
+					slot.buffer = m_free_buffers.back();
+					m_free_buffers.pop_back();
+				}
+
+				push(slot_idx);
+				++batch.pending;
+			}
+
+			// Waiting for completions is only useful if some requests will complete.
+			bool reaper = !m_reaping;
+			unsigned to_submit = m_to_submit;
+			bool wait = reaper && (m_submitted || to_submit);
+
+			// Claimed requests are counted as submitted until enter() returns, so that the count is never too low.
+			m_to_submit = 0;
+			m_submitted += to_submit;
+			m_reaping = m_reaping || reaper;
+
+			bool failed = false;
+
+			if (to_submit || wait) {
+				unsigned submitted = 0;
+
+				lock.unlock();
+				try {
+					submitted = enter(to_submit, wait);
+				} catch (const std::system_error &e) {
+					// Requests of this batch may already be in the ring, so the error is reported once they complete.
+					if (!batch.error)
+						batch.error = e.code().value();
+					failed = true;
+				}
+				lock.lock();
+
+				m_to_submit += to_submit - submitted;
+				m_submitted -= to_submit - submitted;
+			}
+
+			if (reaper) {
+				reap();
+				m_reaping = false;
+				m_reaped_cv.notify_all();
+			} else if (m_reaping && !m_to_submit) {
+				m_reaped_cv.wait(lock);
+			}
+
+			if (failed) {
+				lock.unlock();
+				std::this_thread::yield();
+				lock.lock();
+			}
+		}
+
+		if (batch.error)
+			throw_system_error(batch.error);
+		if (batch.eof)
+			throw IOStream::eof{};
+	}
+};
+#endif // RAWZ_HAVE_IO_URING
+
+
+class AsyncIOStream : public IOStream {
+	int m_fd;
+	std::unique_ptr<ReadEngine> m_engine;
+	uint64_t m_offset;
+	uint64_t m_length;
+	uint64_t m_where;
+public:
+	AsyncIOStream(int fd, uint64_t offset, const rawz_io_options &options) try :
+		m_fd{ fd },
+		m_offset{ offset },
+		m_length{},
+		m_where{}
+	{
+		struct stat st{};
+		if (fstat(m_fd, &st))
+			throw_system_error();
+
+		m_length = st.st_size;
+		if (m_offset > m_length)
+			throw std::runtime_error{ "offset past end of file" };
+
+		unsigned depth = options.queue_depth ? std::min(options.queue_depth, max_queue_depth) : default_queue_depth;
+		unsigned threads = options.threads ? std::min(options.threads, max_threads) : default_threads;
+
+#ifdef RAWZ_HAVE_IO_URING
+		try {
+			m_engine = std::make_unique<UringEngine>(m_fd, depth, !!options.fixed_buffers);
+		} catch (const std::system_error &) {
+			// Kernel too old, or io_uring disabled by policy.
+		}
+#endif
+		if (!m_engine)
+			m_engine = std::make_unique<ThreadPoolEngine>(m_fd, threads);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+
+	AsyncIOStream(const AsyncIOStream &) = delete;
+
+	~AsyncIOStream()
+	{
+		m_engine.reset();
+		close(m_fd);
+	}
+
+	AsyncIOStream &operator=(const AsyncIOStream &) = delete;
+
+	bool seekable() const override { return true; }
+
+	void read(void *buf, size_t n) override
+	{
+		IORequest req{ m_where, buf, n };
+		read_batch(&req, 1);
+		m_where += n;
+	}
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		CoalescedBatch batch{ req, count, nullptr };
+		std::vector<ReadOp> ops;
+
+		// Requests that are not contiguous in memory are submitted as they are, rather than staged.
+		for (size_t i = 0; i < batch.size(); ++i) {
+			size_t piece_count;
+			const IORequest *pieces = batch.pieces(i, piece_count);
+			if (pieces)
+				split_requests(pieces, piece_count, m_offset, ops);
+			else
+				split_requests(batch.data() + i, 1, m_offset, ops);
+		}
+
+		m_read_requests += count;
+		m_read_calls += ops.size();
+		m_engine->read(ops.data(), ops.size());
+	}
+
+	void seek(int64_t offset, int whence) override
+	{
+		m_where = seek_address(offset, whence, m_offset, m_offset + m_where, m_length) - m_offset;
+	}
+
+	uint64_t tell() const override { return m_where; }
+
+	uint64_t length() const override { return m_length - m_offset; }
+
+	void refresh() override
+	{
+		struct stat st{};
+		if (fstat(m_fd, &st))
+			throw_system_error();
+		m_length = st.st_size;
+	}
+
+	void advise(uint64_t offset, uint64_t n, Advice advice) noexcept override
+	{
+		if (offset <= m_length - m_offset)
+			fadvise_range(m_fd, m_offset + offset, n, advice);
+	}
+
+	bool is_hole(uint64_t offset, uint64_t n) noexcept override
+	{
+		return offset <= m_length - m_offset && n <= m_length - m_offset - offset && is_hole_range(m_fd, m_offset + offset, n);
+	}
+
+	bool file_id(uint64_t &device, uint64_t &inode) const noexcept override { return fd_file_id(m_fd, device, inode); }
+};
+
+} // namespace
+#endif // _WIN32
+
+
+std::unique_ptr<IOStream> create_async_stream(const char *path, bool seekable, uint64_t offset, const rawz_io_options &options)
+{
+#ifdef _WIN32
+	return create_stdio_stream(path, seekable, offset, options);
+#else
+	if (!seekable)
+		return create_stdio_stream(path, seekable, offset, options);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw_system_error();
+
+	return create_async_stream_fd(fd, seekable, offset, options);
+#endif
+}
+
+std::unique_ptr<IOStream> create_async_stream_fd(int fd, bool seekable, uint64_t offset, const rawz_io_options &options)
+{
+#ifdef _WIN32
+	return create_stdio_stream_fd(fd, seekable, offset, options);
+#else
+	if (!seekable || !is_regular_file(fd))
+		return create_stdio_stream_fd(fd, seekable, offset, options);
+
+	return std::make_unique<AsyncIOStream>(fd, offset, options);
+#endif
+}
+
+} // namespace rawz
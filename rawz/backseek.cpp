@@ -0,0 +1,256 @@
+#ifdef __GNUC__
+  #define _FILE_OFFSET_BITS 64
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+#include "io.h"
+
+#ifdef _MSC_VER
+  #define fseeko _fseeki64
+#endif
+
+namespace rawz {
+
+namespace {
+
+constexpr size_t chunk_size = 1UL << 16;
+
+
+struct FileCloser {
+	void operator()(std::FILE *f) { if (f) std::fclose(f); }
+};
+
+
+// Fixed-size window over the most recent bytes of a stream, addressed by absolute position.
+class RingBuffer {
+	std::vector<uint8_t> m_data;
+public:
+	explicit RingBuffer(size_t capacity) : m_data(capacity) {}
+
+	uint64_t capacity() const { return m_data.size(); }
+
+	void write(uint64_t pos, const uint8_t *buf, size_t n)
+	{
+		while (n) {
+			size_t idx = static_cast<size_t>(pos % m_data.size());
+			size_t count = std::min(n, m_data.size() - idx);
+
+			std::memcpy(m_data.data() + idx, buf, count);
+			pos += count;
+			buf += count;
+			n -= count;
+		}
+	}
+
+	void read(uint64_t pos, uint8_t *buf, size_t n) const
+	{
+		while (n) {
+			size_t idx = static_cast<size_t>(pos % m_data.size());
+			size_t count = std::min(n, m_data.size() - idx);
+
+			std::memcpy(buf, m_data.data() + idx, count);
+			pos += count;
+			buf += count;
+			n -= count;
+		}
+	}
+};
+
+// Same as RingBuffer, but stored in an anonymous temporary file.
+class SpillFile {
+	std::unique_ptr<std::FILE, FileCloser> m_file;
+	uint64_t m_capacity;
+
+	void seek(uint64_t pos)
+	{
+		if (fseeko(m_file.get(), static_cast<int64_t>(pos % m_capacity), SEEK_SET))
+			throw std::system_error{ errno, std::generic_category() };
+	}
+public:
+	explicit SpillFile(uint64_t capacity) : m_file{ std::tmpfile() }, m_capacity{ capacity }
+	{
+		if (!m_file)
+			throw std::system_error{ errno, std::generic_category() };
+	}
+
+	uint64_t capacity() const { return m_capacity; }
+
+	void write(uint64_t pos, const uint8_t *buf, size_t n)
+	{
+		while (n) {
+			size_t count = static_cast<size_t>(std::min(static_cast<uint64_t>(n), m_capacity - pos % m_capacity));
+
+			seek(pos);
+			if (std::fwrite(buf, 1, count, m_file.get()) != count)
+				throw std::system_error{ errno, std::generic_category() };
+
+			pos += count;
+			buf += count;
+			n -= count;
+		}
+	}
+
+	void read(uint64_t pos, uint8_t *buf, size_t n)
+	{
+		while (n) {
+			size_t count = static_cast<size_t>(std::min(static_cast<uint64_t>(n), m_capacity - pos % m_capacity));
+
+			seek(pos);
+			if (std::fread(buf, 1, count, m_file.get()) != count)
+				throw std::runtime_error{ "temporary file read error" };
+
+			pos += count;
+			buf += count;
+			n -= count;
+		}
+	}
+};
+
+
+// Keeps the most recent bytes of a non-seekable stream, so that positional reads may go backwards by a bounded amount.
+class BackseekIOStream : public IOStream {
+	std::unique_ptr<IOStream> m_io;
+	RingBuffer m_ring;
+	std::unique_ptr<SpillFile> m_spill;
+	std::unique_ptr<uint8_t[]> m_skip_buffer; // Discarded data of forward skips. Allocated on first use.
+	uint64_t m_end; // Bytes consumed from m_io.
+	uint64_t m_where;
+	std::mutex m_mutex;
+
+	uint64_t window_begin() const
+	{
+		uint64_t window = std::max(m_ring.capacity(), m_spill ? m_spill->capacity() : 0);
+		return m_end - std::min(m_end, window);
+	}
+
+	void append(const uint8_t *buf, size_t n)
+	{
+		// Only the tail of a large read fits into the window.
+		size_t tail = static_cast<size_t>(std::min(static_cast<uint64_t>(n), m_ring.capacity()));
+		m_ring.write(m_end + n - tail, buf + n - tail, tail);
+
+		if (m_spill) {
+			size_t spill_tail = static_cast<size_t>(std::min(static_cast<uint64_t>(n), m_spill->capacity()));
+			m_spill->write(m_end + n - spill_tail, buf + n - spill_tail, spill_tail);
+		}
+
+		m_end += n;
+	}
+
+	// Reads from the underlying stream and records the data in the window.
+	void consume(uint8_t *buf, size_t n)
+	{
+		m_io->read(buf, n);
+		append(buf, n);
+	}
+
+	void skip_to(uint64_t pos)
+	{
+		if (m_end < pos && !m_skip_buffer)
+			m_skip_buffer = std::make_unique<uint8_t[]>(chunk_size);
+
+		while (m_end < pos) {
+			size_t count = static_cast<size_t>(std::min(static_cast<uint64_t>(chunk_size), pos - m_end));
+			consume(m_skip_buffer.get(), count);
+		}
+	}
+
+	void copy_from_window(uint64_t pos, uint8_t *buf, size_t n)
+	{
+		if (pos < window_begin())
+			throw std::runtime_error{ "offset before backward seek window" };
+
+		uint64_t ring_begin = m_end - std::min(m_end, m_ring.capacity());
+
+		// The part still in memory is copied from the ring, the rest from the temporary file.
+		if (pos < ring_begin) {
+			size_t count = static_cast<size_t>(std::min(static_cast<uint64_t>(n), ring_begin - pos));
+			m_spill->read(pos, buf, count);
+			pos += count;
+			buf += count;
+			n -= count;
+		}
+
+		m_ring.read(pos, buf, n);
+	}
+
+	void read_locked(uint64_t pos, uint8_t *buf, size_t n)
+	{
+		if (pos < m_end) {
+			size_t count = static_cast<size_t>(std::min(static_cast<uint64_t>(n), m_end - pos));
+			copy_from_window(pos, buf, count);
+			pos += count;
+			buf += count;
+			n -= count;
+		}
+
+		skip_to(pos);
+		consume(buf, n);
+	}
+public:
+	BackseekIOStream(std::unique_ptr<IOStream> io, size_t window_bytes, uint64_t spill_bytes) :
+		m_io{ std::move(io) },
+		m_ring{ std::max(window_bytes, static_cast<size_t>(1)) },
+		m_end{ m_io->tell() },
+		m_where{ m_end }
+	{
+		if (spill_bytes)
+			m_spill = std::make_unique<SpillFile>(spill_bytes);
+	}
+
+	bool seekable() const override { return false; }
+
+	void read(void *buf, size_t n) override
+	{
+		read_at(m_where, buf, n);
+		m_where += n;
+	}
+
+	void seek(int64_t offset, int whence) override
+	{
+		if (whence == seek_end)
+			throw std::runtime_error{ "stream length unknown" };
+
+		m_where = seek_address(offset, whence, 0, m_where, UINT64_MAX);
+	}
+
+	uint64_t tell() const override { return m_where; }
+
+	uint64_t length() const override { return m_io->length(); }
+
+	rawz_stream_stats stats() const noexcept override { return m_io->stats(); }
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		// Requests are served in ascending order, so that the stream only moves forward within a batch.
+		std::vector<size_t> order(count);
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [=](size_t a, size_t b) { return req[a].offset < req[b].offset; });
+
+		std::lock_guard<std::mutex> lock{ m_mutex };
+
+		for (size_t i : order) {
+			read_locked(req[i].offset, static_cast<uint8_t *>(req[i].buf), req[i].n);
+		}
+	}
+};
+
+} // namespace
+
+
+std::unique_ptr<IOStream> create_backseek_stream(std::unique_ptr<IOStream> io, size_t window_bytes, uint64_t spill_bytes)
+{
+	return std::make_unique<BackseekIOStream>(std::move(io), window_bytes, spill_bytes);
+}
+
+} // namespace rawz
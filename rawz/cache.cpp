@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "checked_int.h"
+#include "common.h"
+#include "stream.h"
+
+namespace rawz {
+
+namespace {
+
+constexpr unsigned MAX_PLANES = 4;
+
+
+// Keeps recently unpacked frames, so that repeated requests for the same frame cost a copy.
+class CachedVideoStream : public VideoStream {
+	struct Buffer {
+		std::vector<uint8_t> data;
+		rawz_frame_info info;
+	};
+
+	typedef std::shared_ptr<Buffer> buffer_ptr;
+
+	struct Entry {
+		int64_t frame;
+		buffer_ptr data;
+	};
+
+	std::unique_ptr<VideoStream> m_stream;
+	size_t m_plane_offset[MAX_PLANES];
+	size_t m_rowsize[MAX_PLANES];
+	unsigned m_height[MAX_PLANES];
+	size_t m_frame_size;
+	size_t m_capacity;
+
+	mutable std::mutex m_mutex;
+	std::list<Entry> m_lru; // Most recently used first.
+	std::unordered_map<int64_t, std::list<Entry>::iterator> m_index;
+	buffer_ptr m_spare;
+	uint64_t m_hits;
+	uint64_t m_misses;
+
+	buffer_ptr lookup(int64_t n)
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+
+		auto it = m_index.find(n);
+		if (it == m_index.end()) {
+			++m_misses;
+			return nullptr;
+		}
+
+		++m_hits;
+		m_lru.splice(m_lru.begin(), m_lru, it->second);
+		return it->second->data;
+	}
+
+	buffer_ptr allocate()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+
+			// Buffers still referenced by a concurrent reader can not be recycled.
+			if (m_spare && m_spare.use_count() == 1)
+				return std::move(m_spare);
+		}
+		return std::make_shared<Buffer>(Buffer{ std::vector<uint8_t>(m_frame_size), {} });
+	}
+
+	void insert(int64_t n, buffer_ptr data)
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+
+		// Another thread read the same frame concurrently.
+		if (m_index.find(n) != m_index.end())
+			return;
+
+		if (m_lru.size() >= m_capacity) {
+			m_index.erase(m_lru.back().frame);
+			m_spare = std::move(m_lru.back().data);
+			m_lru.pop_back();
+		}
+
+		m_lru.push_front({ n, std::move(data) });
+		m_index[n] = m_lru.begin();
+	}
+
+	void copy_out(const Buffer &buffer, void * const planes[4], const ptrdiff_t stride[4], rawz_frame_info *info) const
+	{
+		*info = buffer.info;
+
+		for (unsigned p = 0; p < MAX_PLANES; ++p) {
+			if (!planes[p] || !m_rowsize[p])
+				continue;
+
+			const uint8_t *src = buffer.data.data() + m_plane_offset[p];
+			void *dst = planes[p];
+
+			for (unsigned i = 0; i < m_height[p]; ++i) {
+				std::memcpy(dst, src, m_rowsize[p]);
+				src += m_rowsize[p];
+				dst = advance_ptr(dst, stride[p]);
+			}
+		}
+	}
+public:
+	CachedVideoStream(std::unique_ptr<VideoStream> stream, const rawz_format &format, size_t max_bytes) :
+		m_stream{ std::move(stream) },
+		m_plane_offset{},
+		m_rowsize{},
+		m_height{},
+		m_frame_size{},
+		m_capacity{},
+		m_hits{},
+		m_misses{}
+	{
+		checked_size_t frame_size = 0;
+
+		for (unsigned p = 0; p < MAX_PLANES; ++p) {
+			if (!(format.planes_mask & (1U << p)))
+				continue;
+
+			unsigned width = is_chroma_plane(p) ? subsampled_dim(format.width, format.subsample_w) : format.width;
+			unsigned height = is_chroma_plane(p) ? subsampled_dim(format.height, format.subsample_h) : format.height;
+			checked_size_t rowsize = checked_size_t{ width } * format.bytes_per_sample;
+
+			m_plane_offset[p] = frame_size.get();
+			m_rowsize[p] = rowsize.get();
+			m_height[p] = height;
+			frame_size += rowsize * height;
+		}
+
+		m_frame_size = frame_size.get();
+		// A limit below one frame still caches one frame, rather than silently disabling the cache.
+		m_capacity = m_frame_size ? std::max<size_t>(max_bytes / m_frame_size, 1) : 0;
+	}
+
+	int64_t framecount() const noexcept override { return m_stream->framecount(); }
+
+	rawz_metadata metadata() const noexcept override { return m_stream->metadata(); }
+
+	rawz_stream_stats stats() const noexcept override
+	{
+		rawz_stream_stats stats = m_stream->stats();
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		stats.cache_hits += m_hits;
+		stats.cache_misses += m_misses;
+		return stats;
+	}
+
+	uint64_t packet_offset(int64_t n) const override { return m_stream->packet_offset(n); }
+
+	uint64_t packet_size() const noexcept override { return m_stream->packet_size(); }
+
+	void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4], rawz_frame_info *info) override
+	{
+		if (!m_capacity) {
+			m_stream->read(n, planes, stride, info);
+			return;
+		}
+
+		if (buffer_ptr data = lookup(n)) {
+			copy_out(*data, planes, stride, info);
+			return;
+		}
+
+		// All planes are read, so that the entry can serve later requests for a different subset.
+		buffer_ptr data = allocate();
+		void *entry_planes[MAX_PLANES] = {};
+		ptrdiff_t entry_stride[MAX_PLANES] = {};
+
+		for (unsigned p = 0; p < MAX_PLANES; ++p) {
+			if (!m_rowsize[p])
+				continue;
+
+			entry_planes[p] = data->data.data() + m_plane_offset[p];
+			entry_stride[p] = static_cast<ptrdiff_t>(m_rowsize[p]);
+		}
+
+		data->info = *info;
+		m_stream->read(n, entry_planes, entry_stride, &data->info);
+		copy_out(*data, planes, stride, info);
+		insert(n, std::move(data));
+	}
+
+	bool map(int64_t n, const void *planes[4], ptrdiff_t stride[4]) override
+	{
+		return m_stream->map(n, planes, stride);
+	}
+};
+
+} // namespace
+
+
+std::unique_ptr<VideoStream> create_cached_stream(std::unique_ptr<VideoStream> stream, const rawz_format &format, size_t max_bytes)
+{
+	return std::make_unique<CachedVideoStream>(std::move(stream), format, max_bytes);
+}
+
+} // namespace rawz
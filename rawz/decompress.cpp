@@ -0,0 +1,479 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "io.h"
+
+#ifdef RAWZ_HAVE_ZSTD
+  #include <zstd.h>
+#endif
+
+#ifdef RAWZ_HAVE_LZ4
+  #include <lz4frame.h>
+#endif
+
+namespace rawz {
+
+namespace {
+
+constexpr uint32_t zstd_magic = 0xFD2FB528;
+constexpr uint32_t lz4_magic = 0x184D2204;
+
+// Seek table of the zstd seekable format. LZ4 treats the table as a skippable frame as well.
+constexpr uint32_t seek_table_magic = 0x184D2A5E;
+constexpr uint32_t seekable_magic = 0x8F92EAB1;
+constexpr size_t skippable_header_size = 8;
+constexpr size_t seek_table_footer_size = 9;
+
+constexpr unsigned default_threads = 4;
+constexpr unsigned max_threads = 64;
+
+
+uint32_t load_le32(const unsigned char *p)
+{
+	return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+
+enum class Codec {
+	zstd,
+	lz4,
+};
+
+struct Chunk {
+	uint64_t compressed_offset;
+	uint64_t offset;
+	size_t compressed_size;
+	size_t size;
+};
+
+
+#ifdef RAWZ_HAVE_ZSTD
+void decompress_zstd(const void *src, size_t src_size, void *dst, size_t dst_size)
+{
+	size_t res = ZSTD_decompress(dst, dst_size, src, src_size);
+	if (ZSTD_isError(res))
+		throw std::runtime_error{ std::string{ "zstd: " } + ZSTD_getErrorName(res) };
+	if (res != dst_size)
+		throw std::runtime_error{ "zstd: frame size does not match seek table" };
+}
+#else
+void decompress_zstd(const void *, size_t, void *, size_t)
+{
+	throw std::runtime_error{ "zstd support not enabled" };
+}
+#endif
+
+#ifdef RAWZ_HAVE_LZ4
+void decompress_lz4(const void *src, size_t src_size, void *dst, size_t dst_size)
+{
+	struct DctxDeleter {
+		void operator()(LZ4F_dctx *dctx) { LZ4F_freeDecompressionContext(dctx); }
+	};
+
+	LZ4F_dctx *dctx_ptr = nullptr;
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx_ptr, LZ4F_VERSION)))
+		throw std::bad_alloc{};
+	std::unique_ptr<LZ4F_dctx, DctxDeleter> dctx{ dctx_ptr };
+
+	const unsigned char *src_p = static_cast<const unsigned char *>(src);
+	unsigned char *dst_p = static_cast<unsigned char *>(dst);
+	size_t src_pos = 0;
+	size_t dst_pos = 0;
+
+	while (true) {
+		size_t src_n = src_size - src_pos;
+		size_t dst_n = dst_size - dst_pos;
+		size_t res = LZ4F_decompress(dctx.get(), dst_p + dst_pos, &dst_n, src_p + src_pos, &src_n, nullptr);
+		if (LZ4F_isError(res))
+			throw std::runtime_error{ std::string{ "lz4: " } + LZ4F_getErrorName(res) };
+
+		src_pos += src_n;
+		dst_pos += dst_n;
+
+		if (!res)
+			break;
+		if (!src_n && !dst_n)
+			throw std::runtime_error{ "lz4: truncated frame" };
+	}
+
+	if (dst_pos != dst_size)
+		throw std::runtime_error{ "lz4: frame size does not match seek table" };
+}
+#else
+void decompress_lz4(const void *, size_t, void *, size_t)
+{
+	throw std::runtime_error{ "lz4 support not enabled" };
+}
+#endif
+
+
+// Presents the decompressed contents of a seekable zstd file, or of LZ4 frames followed by the same seek table.
+// Chunks are decompressed on demand and kept in a small cache. Sequential access decompresses ahead on worker threads.
+class DecompressIOStream : public IOStream {
+	struct Entry {
+		std::vector<unsigned char> data;
+		std::exception_ptr error;
+		uint64_t last_use;
+		bool ready;
+	};
+
+	std::unique_ptr<IOStream> m_io;
+	Codec m_codec;
+	std::vector<Chunk> m_chunks;
+	uint64_t m_offset;
+	uint64_t m_length;
+	uint64_t m_where;
+	size_t m_capacity;
+	unsigned m_depth;
+
+	std::mutex m_mutex;
+	std::condition_variable m_ready_cv;
+	std::condition_variable m_work_cv;
+	std::unordered_map<size_t, std::shared_ptr<Entry>> m_cache;
+	std::deque<size_t> m_queue;
+	uint64_t m_clock;
+	size_t m_last_chunk;
+	bool m_quit;
+	std::vector<std::thread> m_threads;
+
+	void load_seek_table()
+	{
+		uint64_t file_length = m_io->length();
+		unsigned char footer[seek_table_footer_size];
+
+		if (file_length < skippable_header_size + seek_table_footer_size)
+			throw std::runtime_error{ "missing seek table" };
+
+		m_io->read_at(file_length - seek_table_footer_size, footer, sizeof(footer));
+		if (load_le32(footer + 5) != seekable_magic)
+			throw std::runtime_error{ "missing seek table" };
+		if (footer[4] & 0x7C)
+			throw std::runtime_error{ "unsupported seek table" };
+
+		uint64_t num_chunks = load_le32(footer);
+		size_t entry_size = footer[4] & 0x80 ? 12 : 8;
+		uint64_t table_size = num_chunks * entry_size + seek_table_footer_size;
+
+		if (table_size + skippable_header_size > file_length)
+			throw std::runtime_error{ "truncated seek table" };
+
+		uint64_t table_offset = file_length - table_size - skippable_header_size;
+		std::vector<unsigned char> table(static_cast<size_t>(table_size + skippable_header_size));
+		m_io->read_at(table_offset, table.data(), table.size());
+
+		if (load_le32(table.data()) != seek_table_magic || load_le32(table.data() + 4) != table_size)
+			throw std::runtime_error{ "invalid seek table" };
+
+		uint64_t compressed_offset = 0;
+		uint64_t offset = 0;
+
+		for (uint64_t i = 0; i < num_chunks; ++i) {
+			const unsigned char *entry = table.data() + skippable_header_size + i * entry_size;
+			uint32_t compressed_size = load_le32(entry);
+			uint32_t size = load_le32(entry + 4);
+
+			if (compressed_size > table_offset - compressed_offset)
+				throw std::runtime_error{ "invalid seek table" };
+
+			// Empty frames can not be the target of a read.
+			if (size)
+				m_chunks.push_back({ compressed_offset, offset, compressed_size, size });
+
+			compressed_offset += compressed_size;
+			offset += size;
+		}
+
+		m_length = offset;
+		if (compressed_offset != table_offset)
+			throw std::runtime_error{ "seek table does not cover file" };
+	}
+
+	void detect_codec()
+	{
+		if (m_chunks.empty())
+			return;
+
+		unsigned char magic[4];
+		m_io->read_at(m_chunks.front().compressed_offset, magic, sizeof(magic));
+
+		if (load_le32(magic) == zstd_magic)
+			m_codec = Codec::zstd;
+		else if (load_le32(magic) == lz4_magic)
+			m_codec = Codec::lz4;
+		else
+			throw std::runtime_error{ "unknown compression format" };
+
+		// Fail on open rather than on the first read.
+#ifndef RAWZ_HAVE_ZSTD
+		if (m_codec == Codec::zstd)
+			throw std::runtime_error{ "zstd support not enabled" };
+#endif
+#ifndef RAWZ_HAVE_LZ4
+		if (m_codec == Codec::lz4)
+			throw std::runtime_error{ "lz4 support not enabled" };
+#endif
+	}
+
+	void decompress(size_t idx, Entry &entry)
+	{
+		const Chunk &chunk = m_chunks[idx];
+
+		// Also called on worker threads, so errors are stored for the reader.
+		try {
+			std::vector<unsigned char> src(chunk.compressed_size);
+			m_io->read_at(chunk.compressed_offset, src.data(), src.size());
+			entry.data.resize(chunk.size);
+
+			if (m_codec == Codec::zstd)
+				decompress_zstd(src.data(), src.size(), entry.data.data(), entry.data.size());
+			else
+				decompress_lz4(src.data(), src.size(), entry.data.data(), entry.data.size());
+		} catch (...) {
+			entry.error = std::current_exception();
+		}
+	}
+
+	// Adds an entry that the caller fills outside the lock. Evicts the least recently used idle entry. Returns nullptr
+	// if all entries are in use.
+	std::shared_ptr<Entry> insert(size_t idx)
+	{
+		while (m_cache.size() >= m_capacity) {
+			auto lru = m_cache.end();
+
+			for (auto it = m_cache.begin(); it != m_cache.end(); ++it) {
+				if (it->second->ready && it->second.use_count() == 1 && (lru == m_cache.end() || it->second->last_use < lru->second->last_use))
+					lru = it;
+			}
+			if (lru == m_cache.end())
+				return nullptr;
+			m_cache.erase(lru);
+		}
+
+		std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+		entry->last_use = ++m_clock;
+		entry->ready = false;
+		m_cache[idx] = entry;
+		return entry;
+	}
+
+	void fill(std::unique_lock<std::mutex> &lock, size_t idx, Entry &entry)
+	{
+		lock.unlock();
+		decompress(idx, entry);
+		lock.lock();
+
+		entry.ready = true;
+		m_ready_cv.notify_all();
+	}
+
+	void schedule(size_t idx)
+	{
+		bool sequential = idx == m_last_chunk || idx == m_last_chunk + 1;
+		m_last_chunk = idx;
+
+		if (!sequential || m_threads.empty())
+			return;
+
+		m_queue.clear();
+		for (size_t i = idx + 1; i < m_chunks.size() && i <= idx + m_depth; ++i) {
+			if (m_cache.find(i) == m_cache.end())
+				m_queue.push_back(i);
+		}
+		if (!m_queue.empty())
+			m_work_cv.notify_all();
+	}
+
+	void worker()
+	{
+		std::unique_lock<std::mutex> lock{ m_mutex };
+
+		while (true) {
+			m_work_cv.wait(lock, [&]() { return m_quit || !m_queue.empty(); });
+			if (m_quit)
+				break;
+
+			size_t idx = m_queue.front();
+			m_queue.pop_front();
+
+			// Requested by a reader in the meantime.
+			if (m_cache.find(idx) != m_cache.end())
+				continue;
+
+			// Read-ahead does not wait for readers to release the cache.
+			std::shared_ptr<Entry> entry = insert(idx);
+			if (!entry) {
+				m_queue.clear();
+				continue;
+			}
+
+			fill(lock, idx, *entry);
+		}
+	}
+
+	std::shared_ptr<Entry> acquire(size_t idx)
+	{
+		std::unique_lock<std::mutex> lock{ m_mutex };
+		std::shared_ptr<Entry> entry;
+
+		while (true) {
+			auto it = m_cache.find(idx);
+			if (it != m_cache.end()) {
+				entry = it->second;
+				break;
+			}
+			if ((entry = insert(idx))) {
+				fill(lock, idx, *entry);
+				break;
+			}
+
+			// Other readers hold every entry. They release them without waiting for space, see release().
+			m_ready_cv.wait(lock);
+		}
+
+		m_ready_cv.wait(lock, [&]() { return entry->ready; });
+		entry->last_use = ++m_clock;
+
+		// Failed chunks are retried by the next reader.
+		if (entry->error) {
+			auto it = m_cache.find(idx);
+			if (it != m_cache.end() && it->second == entry)
+				m_cache.erase(it);
+			m_ready_cv.notify_all();
+			std::rethrow_exception(entry->error);
+		}
+
+		schedule(idx);
+		return entry;
+	}
+
+	// Drops a reference from acquire(), so that the entry can be evicted.
+	void release(std::shared_ptr<Entry> &entry)
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		entry.reset();
+		m_ready_cv.notify_all();
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			m_quit = true;
+		}
+		m_work_cv.notify_all();
+
+		for (std::thread &th : m_threads) {
+			th.join();
+		}
+		m_threads.clear();
+	}
+public:
+	DecompressIOStream(std::unique_ptr<IOStream> io, uint64_t offset, const rawz_io_options &options) :
+		m_io{ std::move(io) },
+		m_codec{},
+		m_offset{ offset },
+		m_length{},
+		m_where{},
+		m_capacity{},
+		m_depth{},
+		m_clock{},
+		m_last_chunk{ SIZE_MAX },
+		m_quit{}
+	{
+		if (!m_io->seekable())
+			throw std::runtime_error{ "compressed input must be seekable" };
+
+		load_seek_table();
+		detect_codec();
+
+		if (m_offset > m_length)
+			throw std::runtime_error{ "offset past end of file" };
+
+		// Each worker decompresses one chunk ahead. The cache holds the read-ahead window and the chunks being read.
+		m_depth = options.threads ? std::min(options.threads, max_threads) : default_threads;
+		m_capacity = m_depth * 2 + 2;
+
+		try {
+			for (unsigned i = 0; i < m_depth; ++i) {
+				m_threads.emplace_back(&DecompressIOStream::worker, this);
+			}
+		} catch (...) {
+			stop();
+			throw;
+		}
+	}
+
+	DecompressIOStream(const DecompressIOStream &) = delete;
+
+	~DecompressIOStream() { stop(); }
+
+	DecompressIOStream &operator=(const DecompressIOStream &) = delete;
+
+	bool seekable() const override { return true; }
+
+	void read(void *buf, size_t n) override
+	{
+		read_at(m_where, buf, n);
+		m_where += n;
+	}
+
+	void seek(int64_t offset, int whence) override
+	{
+		m_where = seek_address(offset, whence, 0, m_where, length());
+	}
+
+	uint64_t tell() const override { return m_where; }
+
+	uint64_t length() const override { return m_length - m_offset; }
+
+	rawz_stream_stats stats() const noexcept override { return m_io->stats(); }
+
+	void release() noexcept override { m_io->release(); }
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		for (size_t i = 0; i < count; ++i) {
+			if (req[i].offset > length() || req[i].n > length() - req[i].offset)
+				throw eof{};
+
+			uint64_t pos = m_offset + req[i].offset;
+			unsigned char *buf = static_cast<unsigned char *>(req[i].buf);
+			size_t n = req[i].n;
+
+			while (n) {
+				auto it = std::upper_bound(m_chunks.begin(), m_chunks.end(), pos, [](uint64_t pos, const Chunk &chunk) { return pos < chunk.offset; });
+				size_t idx = static_cast<size_t>(it - m_chunks.begin()) - 1;
+				const Chunk &chunk = m_chunks[idx];
+
+				std::shared_ptr<Entry> entry = acquire(idx);
+				size_t chunk_offset = static_cast<size_t>(pos - chunk.offset);
+				size_t count = std::min(n, chunk.size - chunk_offset);
+
+				std::copy_n(entry->data.data() + chunk_offset, count, buf);
+				release(entry);
+				pos += count;
+				buf += count;
+				n -= count;
+			}
+		}
+	}
+};
+
+} // namespace
+
+
+std::unique_ptr<IOStream> create_decompress_stream(std::unique_ptr<IOStream> io, uint64_t offset, const rawz_io_options &options)
+{
+	return std::make_unique<DecompressIOStream>(std::move(io), offset, options);
+}
+
+} // namespace rawz
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include "io.h"
+
+namespace rawz {
+
+namespace {
+
+constexpr std::chrono::milliseconds default_timeout{ 10000 };
+constexpr std::chrono::milliseconds min_poll_interval{ 1 };
+constexpr std::chrono::milliseconds max_poll_interval{ 100 };
+
+
+// Treats the end of a file that is still being written as a temporary condition.
+class FollowIOStream : public IOStream {
+	std::unique_ptr<IOStream> m_io;
+	std::chrono::milliseconds m_timeout;
+
+	// Exclusive while refreshing the length, which the underlying stream does not synchronize.
+	mutable std::shared_mutex m_mutex;
+
+	uint64_t current_length() const
+	{
+		std::lock_guard<std::shared_mutex> lock{ m_mutex };
+		m_io->refresh();
+		return m_io->length();
+	}
+
+	// Polls the file length with exponential backoff.
+	void wait_for_length(uint64_t end) const
+	{
+		auto deadline = std::chrono::steady_clock::now() + m_timeout;
+		std::chrono::milliseconds interval = min_poll_interval;
+
+		while (current_length() < end) {
+			auto now = std::chrono::steady_clock::now();
+			if (now >= deadline)
+				throw eof{};
+
+			std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(interval, deadline - now));
+			interval = std::min(interval * 2, max_poll_interval);
+		}
+	}
+public:
+	FollowIOStream(std::unique_ptr<IOStream> io, unsigned timeout_ms) :
+		m_io{ std::move(io) },
+		m_timeout{ timeout_ms ? std::chrono::milliseconds{ timeout_ms } : default_timeout }
+	{}
+
+	bool seekable() const override { return m_io->seekable(); }
+
+	void read(void *buf, size_t n) override
+	{
+		wait_for_length(m_io->tell() + n);
+
+		std::shared_lock<std::shared_mutex> lock{ m_mutex };
+		m_io->read(buf, n);
+	}
+
+	void seek(int64_t offset, int whence) override
+	{
+		std::shared_lock<std::shared_mutex> lock{ m_mutex };
+		m_io->seek(offset, whence);
+	}
+
+	uint64_t tell() const override { return m_io->tell(); }
+
+	uint64_t length() const override { return current_length(); }
+
+	void refresh() override { current_length(); }
+
+	rawz_stream_stats stats() const noexcept override { return m_io->stats(); }
+
+	void advise(uint64_t offset, uint64_t n, Advice advice) noexcept override
+	{
+		std::shared_lock<std::shared_mutex> lock{ m_mutex };
+		m_io->advise(offset, n, advice);
+	}
+
+	bool is_hole(uint64_t offset, uint64_t n) noexcept override
+	{
+		std::shared_lock<std::shared_mutex> lock{ m_mutex };
+		return m_io->is_hole(offset, n);
+	}
+
+	void release() noexcept override
+	{
+		std::shared_lock<std::shared_mutex> lock{ m_mutex };
+		m_io->release();
+	}
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		uint64_t end = 0;
+
+		for (size_t i = 0; i < count; ++i) {
+			if (req[i].n > UINT64_MAX - req[i].offset)
+				throw eof{};
+			end = std::max(end, req[i].offset + req[i].n);
+		}
+		wait_for_length(end);
+
+		std::shared_lock<std::shared_mutex> lock{ m_mutex };
+		m_io->read_batch(req, count);
+	}
+};
+
+} // namespace
+
+
+std::unique_ptr<IOStream> create_follow_stream(std::unique_ptr<IOStream> io, unsigned timeout_ms)
+{
+	return std::make_unique<FollowIOStream>(std::move(io), timeout_ms);
+}
+
+} // namespace rawz
@@ -5,6 +5,7 @@
 #include "checked_int.h"
 #include "common.h"
 #include "io.h"
+#include "staging.h"
 #include "stream.h"
 
 namespace p2p = p2p_rawz;
@@ -13,6 +14,9 @@ namespace rawz {
 
 namespace {
 
+// Rows are read in bands of approximately this size.
+constexpr size_t band_size = 1UL << 22;
+
 typedef decltype(&p2p::packed_to_planar<p2p::packed_rgb24>::unpack) unpack_func;
 
 template <class T>
@@ -33,11 +37,12 @@ size_t v210_rowsize(unsigned width)
 
 class InterleavedVideoStream : public VideoStream {
 	std::unique_ptr<IOStream> m_io;
+	PacketLayout m_layout;
 	rawz_format m_format;
 	unpack_func m_unpack;
 	size_t m_rowsize;
 	uint64_t m_packet_size;
-	int64_t m_frameno;
+	StagingPool m_staging;
 
 	void init_format()
 	{
@@ -90,7 +95,7 @@ class InterleavedVideoStream : public VideoStream {
 		rowsize = ceil_aligned(rowsize, m_format.alignment);
 
 		m_rowsize = rowsize.get();
-		m_packet_size = (rowsize * m_format.height).get();
+		m_packet_size = m_layout.packet_size((rowsize * m_format.height).get());
 	}
 
 	void init_unpack()
@@ -122,13 +127,13 @@ class InterleavedVideoStream : public VideoStream {
 		}
 	}
 public:
-	InterleavedVideoStream(std::unique_ptr<IOStream> io, const rawz_format &format) :
+	InterleavedVideoStream(std::unique_ptr<IOStream> io, const rawz_format &format, const PacketLayout &layout) :
 		m_io{ std::move(io) },
+		m_layout(layout),
 		m_format(format),
 		m_unpack{},
 		m_rowsize{},
-		m_packet_size{},
-		m_frameno{ -1 }
+		m_packet_size{}
 	{
 		init_format();
 		if (!is_valid_format(format))
@@ -137,48 +142,63 @@ public:
 		init_unpack();
 	}
 
-	int64_t framecount() const noexcept
-	{
-		return m_io->seekable() ? m_io->length() / m_packet_size : 0;
-	}
+	int64_t framecount() const noexcept { return m_layout.framecount(*m_io, m_packet_size); }
 
 	rawz_metadata metadata() const noexcept { return default_metadata(); }
 
-	void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4]) try
+	rawz_stream_stats stats() const noexcept { return m_io->stats(); }
+
+	uint64_t packet_offset(int64_t n) const { return m_layout.packet_offset(n, m_packet_size); }
+
+	uint64_t packet_size() const noexcept { return m_packet_size; }
+
+	void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4], rawz_frame_info *info)
 	{
-		seek_to_frame(m_io.get(), m_frameno, n, m_packet_size);
+		uint64_t offset = packet_offset(n) + m_layout.prefix();
+		std::vector<unsigned char> header(m_layout.header_size());
+		std::vector<IORequest> req;
 
 		void *plane_ptrs[4] = { planes[0], planes[1], planes[2], planes[3] };
-		std::vector<uint8_t> buffer(m_rowsize);
 		unsigned height = m_format.height;
 		unsigned vstep = 1U << m_format.subsample_h;
+		unsigned band_rows = static_cast<unsigned>(std::min(std::max(band_size / m_rowsize, static_cast<size_t>(1)), static_cast<size_t>(height)));
+
+		// The band shares one staging buffer with a scratch row for planes that were not requested.
+		size_t band_bytes = ceil_aligned(m_rowsize * band_rows, StagingPool::log2_alignment);
+		StagingBuffer staging = m_staging.acquire(band_bytes + static_cast<size_t>(m_format.width) * m_format.bytes_per_sample);
+		uint8_t *buffer = staging.data();
 
-		std::vector<uint8_t> tmp;
 		for (unsigned p = 0; p < 3; ++p) {
 			// Only the alpha channel is optional when invoking p2p.
-			if (!plane_ptrs[p]) {
-				tmp.resize(m_format.width * m_format.bytes_per_sample);
-				plane_ptrs[p] = tmp.data();
-			}
+			if (!plane_ptrs[p])
+				plane_ptrs[p] = buffer + band_bytes;
 		}
 
-		for (unsigned i = 0; i < height; i += vstep) {
-			m_io->read(buffer.data(), buffer.size());
-			m_unpack(buffer.data(), plane_ptrs, 0, m_format.width);
+		for (unsigned i = 0; i < height; i += band_rows) {
+			unsigned rows = std::min(band_rows, height - i);
+			req.clear();
+
+			// The packet header is read together with the first band.
+			if (!i)
+				m_layout.header_request(req, offset - m_layout.prefix(), header.data());
+			req.push_back({ offset + static_cast<uint64_t>(i) * m_rowsize, buffer, m_rowsize * rows });
+			m_io->read_batch(req.data(), req.size());
+
+			for (unsigned ii = 0; ii < rows; ii += vstep) {
+				m_unpack(buffer + static_cast<size_t>(ii) * m_rowsize, plane_ptrs, 0, m_format.width);
 
-			for (unsigned p = 0; p < 4; ++p) {
-				if (!plane_ptrs[p])
-					continue;
+				// The scratch row is reused.
+				for (unsigned p = 0; p < 4; ++p) {
+					if (!planes[p])
+						continue;
 
-				unsigned plane_vstep = is_chroma_plane(p) ? 1 : vstep;
-				plane_ptrs[p] = advance_ptr(plane_ptrs[p], stride[p] * static_cast<ptrdiff_t>(plane_vstep));
+					unsigned plane_vstep = is_chroma_plane(p) ? 1 : vstep;
+					plane_ptrs[p] = advance_ptr(plane_ptrs[p], stride[p] * static_cast<ptrdiff_t>(plane_vstep));
+				}
 			}
 		}
 
-		++m_frameno;
-	} catch (...) {
-		m_frameno = -1;
-		throw;
+		m_layout.decode_header(header.data(), info);
 	}
 
 	const rawz_format &format() const { return m_format; }
@@ -187,9 +207,9 @@ public:
 } // namespace
 
 
-std::unique_ptr<VideoStream> create_interleaved_stream(std::unique_ptr<IOStream> io, rawz_format *format)
+std::unique_ptr<VideoStream> create_interleaved_stream(std::unique_ptr<IOStream> io, rawz_format *format, const PacketLayout &layout)
 {
-	std::unique_ptr<InterleavedVideoStream> stream = std::make_unique<InterleavedVideoStream>(std::move(io), *format);
+	std::unique_ptr<InterleavedVideoStream> stream = std::make_unique<InterleavedVideoStream>(std::move(io), *format, layout);
 	*format = stream->format();
 	return std::move(stream);
 }
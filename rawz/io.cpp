@@ -2,32 +2,40 @@
   #define _FILE_OFFSET_BITS 64
 #endif
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <climits>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <system_error>
+#include <vector>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "io.h"
+#include "staging.h"
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/uio.h>
+  #include <unistd.h>
+#endif
 
 #ifdef _WIN32
   #include <filesystem>
-
-  #define WSTR(x) L##x
-  #define filechar_t wchar_t
-#else
-  #define WSTR(x) x
-  #define filechar_t char
 #endif
 
 #ifdef _MSC_VER
-  #define fdopen _fdopen
-  #define fileno _fileno
-  #define fseeko _fseeki64
+  #include <fcntl.h>
+  #include <io.h>
+
+  #define close(fd) _close(fd)
   #define fstat _fstat64
-  #define ftello _ftelli64
   #define stat __stat64
 #else
   static_assert(sizeof(off_t) == sizeof(int64_t), "64-bit files required");
@@ -43,32 +51,28 @@ static_assert(IOStream::seek_cur == SEEK_CUR, "seek macro mismatch");
 static_assert(IOStream::seek_end == SEEK_END, "seek macro mismatch");
 
 
-[[noreturn]] void throw_system_error()
+// Staging buffers of merged cursor reads, shared by all streams.
+StagingPool &coalesce_pool()
 {
-	throw std::system_error{ errno, std::generic_category() };
+	static StagingPool pool;
+	return pool;
 }
 
-
-struct FileCloser {
-	void operator()(std::FILE *f) { if (f) std::fclose(f); }
-};
-
-typedef std::unique_ptr<std::FILE, FileCloser> unique_file;
-
-
-unique_file unicode_open(const char *path, const filechar_t *mode)
+int unicode_open(const char *path)
 {
 #ifdef _WIN32
-	return unique_file{ _wfopen( std::filesystem::u8path(path).c_str(), mode) };
+	int fd = _wopen(std::filesystem::u8path(path).c_str(), _O_RDONLY | _O_BINARY);
 #else
-	return unique_file{ std::fopen(path, mode) };
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
 #endif
+	if (fd < 0)
+		throw_system_error();
+	return fd;
 }
 
-uint64_t file_length(std::FILE *file)
+uint64_t file_length(int fd)
 {
 	struct stat st{};
-	int fd = fileno(file);
 	static_assert(sizeof(st.st_size) == sizeof(int64_t), "");
 
 	if (fstat(fd, &st))
@@ -78,126 +82,665 @@ uint64_t file_length(std::FILE *file)
 	return st.st_size;
 }
 
+// Reads up to n bytes from an absolute offset, or from the current position if the file is not seekable.
+// Returns 0 at end of file.
+size_t read_some(int fd, void *buf, size_t n, bool seekable, uint64_t offset)
+{
+	while (true) {
+#ifdef _WIN32
+		if (seekable && _lseeki64(fd, static_cast<int64_t>(offset), SEEK_SET) < 0)
+			throw_system_error();
+		int res = _read(fd, buf, static_cast<unsigned>(std::min(n, static_cast<size_t>(INT_MAX))));
+#else
+		ssize_t res = seekable ? pread(fd, buf, n, static_cast<off_t>(offset)) : ::read(fd, buf, n);
+#endif
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0)
+			throw_system_error();
+		return static_cast<size_t>(res);
+	}
+}
 
+// Buffered reads from a file descriptor. Small reads, such as headers and frame tags, are served from the buffer.
 class FileIOStream : public IOStream {
-	unique_file m_file;
+	static constexpr size_t default_buffer_size = 256UL << 10;
+	static constexpr size_t min_buffer_size = 64UL << 10;
+	static constexpr size_t max_buffer_size = 8UL << 20;
+
+	// Larger reads, such as whole rows and planes, bypass the buffer.
+	static constexpr size_t direct_threshold = 64UL << 10;
+
+	int m_fd;
+	std::unique_ptr<unsigned char[]> m_buffer;
+	size_t m_buffer_size;
+	uint64_t m_buffer_pos;
+	size_t m_buffer_count;
 	uint64_t m_offset;
 	uint64_t m_length;
-	mutable uint64_t m_where;
+	uint64_t m_where; // Bytes consumed if not seekable.
 	bool m_seekable;
-	mutable bool m_valid_pos;
 
-	void do_tell() const
+#ifndef _WIN32
+	// Reads until iov is filled or end of file, consuming iov. Returns the number of bytes read.
+	size_t preadv_full(std::vector<iovec> &iov, uint64_t offset)
 	{
-		int64_t pos = ftello(m_file.get());
-		if (pos < 0 || static_cast<uint64_t>(pos) < m_offset)
-			throw_system_error();
-		m_where = pos;
-		m_valid_pos = true;
+		size_t count = 0;
+		size_t i = 0;
+
+		++m_read_calls;
+
+		while (i < iov.size()) {
+			ssize_t res = preadv(m_fd, iov.data() + i, static_cast<int>(iov.size() - i), static_cast<off_t>(offset + count));
+			if (res < 0 && errno == EINTR)
+				continue;
+			if (res < 0)
+				throw_system_error();
+			if (res == 0)
+				break;
+
+			count += static_cast<size_t>(res);
+
+			for (size_t left = static_cast<size_t>(res); left;) {
+				size_t cur = std::min(left, iov[i].iov_len);
+				iov[i].iov_base = static_cast<unsigned char *>(iov[i].iov_base) + cur;
+				iov[i].iov_len -= cur;
+				left -= cur;
+				i += !iov[i].iov_len;
+			}
+		}
+
+		return count;
+	}
+
+	// Reads the pieces of a merged request straight into their destinations. Gaps are read into a scratch buffer.
+	void read_pieces(const IORequest *pieces, size_t count)
+	{
+		unsigned char gap[CoalescedBatch::max_gap];
+		std::vector<iovec> iov;
+		size_t k = 0;
+
+		while (k < count) {
+			uint64_t begin = pieces[k].offset;
+			uint64_t pos = begin;
+
+			// Overlapping pieces, and pieces past a gap that is too large, start another read.
+			iov.clear();
+			for (; k < count && iov.size() + 2 <= IOV_MAX; ++k) {
+				const IORequest &cur = pieces[k];
+
+				if (cur.offset < pos || cur.offset - pos > sizeof(gap))
+					break;
+				if (cur.offset > pos)
+					iov.push_back({ gap, static_cast<size_t>(cur.offset - pos) });
+
+				iov.push_back({ cur.buf, cur.n });
+				pos = cur.offset + cur.n;
+			}
+
+			if (preadv_full(iov, m_offset + begin) != pos - begin)
+				throw eof{};
+		}
+	}
+#endif
+
+	size_t read_direct(void *buf, size_t n)
+	{
+		++m_read_calls;
+		return read_some(m_fd, buf, n, m_seekable, m_where);
+	}
+
+	void fill()
+	{
+		m_buffer_count = 0;
+		m_buffer_pos = m_where;
+		m_buffer_count = read_direct(m_buffer.get(), m_buffer_size);
 	}
 public:
-	FileIOStream(unique_file file, bool seekable, uint64_t offset) :
-		m_file{ std::move(file) },
+	FileIOStream(int fd, bool seekable, uint64_t offset, const rawz_io_options &options) try :
+		m_fd{ fd },
+		m_buffer_size{},
+		m_buffer_pos{},
+		m_buffer_count{},
 		m_offset{},
 		m_length{},
 		m_where{},
-		m_seekable{ seekable },
-		m_valid_pos{}
+		m_seekable{ seekable }
 	{
+#ifdef _WIN32
+		_setmode(m_fd, _O_BINARY);
+#endif
 		if (seekable) {
 			m_offset = offset;
-			m_length = file_length(m_file.get());
+			m_length = file_length(m_fd);
 
 			if (m_offset > m_length)
 				throw std::runtime_error{ "offset past end of file" };
-			if (fseeko(m_file.get(), m_offset, SEEK_SET))
-				throw std::runtime_error{ "seek error" };
 
-			do_tell();
+			m_where = m_offset;
 		}
+
+		size_t buffer_size = options.buffer_size ? options.buffer_size : default_buffer_size;
+		m_buffer_size = std::min(std::max(buffer_size, min_buffer_size), max_buffer_size);
+		m_buffer = std::make_unique<unsigned char[]>(m_buffer_size);
+	} catch (...) {
+		close(fd);
+		throw;
 	}
 
+	FileIOStream(const FileIOStream &) = delete;
+
+	~FileIOStream() { close(m_fd); }
+
+	FileIOStream &operator=(const FileIOStream &) = delete;
+
 	bool seekable() const override { return m_seekable; }
 
 	void read(void *buf, size_t n) override
 	{
-		std::FILE *file = m_file.get();
 		unsigned char *buf_p = static_cast<unsigned char *>(buf);
 
 		while (n) {
-			size_t res = std::fread(buf_p, 1, n, file);
-			assert(res <= n);
-			m_where += res;
-			n -= res;
+			size_t count;
 
-			if (std::ferror(file))
-				throw_system_error();
-			if (std::feof(file))
-				throw eof{};
+			if (m_where >= m_buffer_pos && m_where - m_buffer_pos < m_buffer_count) {
+				size_t buffer_offset = static_cast<size_t>(m_where - m_buffer_pos);
+				count = std::min(n, m_buffer_count - buffer_offset);
+				std::memcpy(buf_p, m_buffer.get() + buffer_offset, count);
+			} else if (n >= direct_threshold) {
+				count = read_direct(buf_p, n);
+				if (!count)
+					throw eof{};
+			} else {
+				fill();
+				if (!m_buffer_count)
+					throw eof{};
+				continue;
+			}
+
+			buf_p += count;
+			m_where += count;
+			n -= count;
 		}
 	}
 
 	void seek(int64_t offset, int whence) override
 	{
-		static_assert(sizeof(offset) == sizeof(m_where), "");
-		static_assert(~int64_t(0) == int64_t(-1), "twos complement");
+		if (!m_seekable)
+			throw std::runtime_error{ "file not seekable" };
 
-		auto throw_error = []() { throw std::runtime_error{ "offset out of bounds" }; };
+		// Deferred until the next read, which will reuse the buffer if possible.
+		m_where = seek_address(offset, whence, m_offset, m_where, m_length);
+	}
 
-		if (!m_valid_pos) {
-			do_tell();
-			if (!m_valid_pos)
-				throw_error();
+	uint64_t tell() const override { return m_where - m_offset; }
+
+	uint64_t length() const override { return m_length - m_offset; }
+
+	void refresh() override
+	{
+		if (m_seekable)
+			m_length = file_length(m_fd);
+	}
+
+#ifndef _WIN32
+	void advise(uint64_t offset, uint64_t n, Advice advice) noexcept override
+	{
+		if (m_seekable && offset <= UINT64_MAX - m_offset)
+			fadvise_range(m_fd, m_offset + offset, n, advice);
+	}
+
+	bool is_hole(uint64_t offset, uint64_t n) noexcept override
+	{
+		return m_seekable && offset <= m_length - m_offset && n <= m_length - m_offset - offset && is_hole_range(m_fd, m_offset + offset, n);
+	}
+
+	bool file_id(uint64_t &device, uint64_t &inode) const noexcept override { return fd_file_id(m_fd, device, inode); }
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		if (!m_seekable) {
+			read_batch_cursor(req, count);
+			return;
 		}
 
-		uint64_t base_address = 0;
-		switch (whence) {
-		case seek_set:
-			base_address = m_offset;
+		CoalescedBatch batch{ req, count, nullptr };
+		m_read_requests += count;
+
+		for (size_t i = 0; i < batch.size(); ++i) {
+			const IORequest &cur = batch.data()[i];
+			size_t piece_count;
+			const IORequest *pieces = batch.pieces(i, piece_count);
+
+			if (cur.offset > static_cast<uint64_t>(INT64_MAX) - m_offset || cur.n > static_cast<uint64_t>(INT64_MAX) - m_offset - cur.offset)
+				throw eof{};
+
+			if (pieces) {
+				read_pieces(pieces, piece_count);
+				continue;
+			}
+
+			++m_read_calls;
+			if (pread_full(m_fd, cur.buf, cur.n, m_offset + cur.offset) != cur.n)
+				throw eof{};
+		}
+	}
+#endif
+};
+
+
+#ifndef _WIN32
+class MMapIOStream : public IOStream {
+	int m_fd;
+	void *m_map;
+	size_t m_map_size;
+	const unsigned char *m_data;
+	uint64_t m_offset;
+	uint64_t m_length;
+	uint64_t m_where;
+
+	void apply_advice(const rawz_io_options &options)
+	{
+		int advice = POSIX_MADV_NORMAL;
+
+		switch (options.advice) {
+		case RAWZ_IO_ADVICE_SEQUENTIAL:
+			advice = POSIX_MADV_SEQUENTIAL;
 			break;
-		case seek_cur:
-			base_address = m_where;
+		case RAWZ_IO_ADVICE_RANDOM:
+			advice = POSIX_MADV_RANDOM;
 			break;
-		case seek_end:
-			base_address = m_length;
+		case RAWZ_IO_ADVICE_WILLNEED:
+			advice = POSIX_MADV_WILLNEED;
 			break;
 		default:
-			throw std::logic_error{ "invalid seek mode" };
+			break;
 		}
 
-		uint64_t new_address = base_address + static_cast<uint64_t>(offset);
+		// Advice is only a hint, so errors are not fatal.
+		if (advice != POSIX_MADV_NORMAL)
+			posix_madvise(m_map, m_map_size, advice);
+#ifdef MADV_HUGEPAGE
+		if (options.hugepages)
+			madvise(m_map, m_map_size, MADV_HUGEPAGE);
+#endif
+	}
+public:
+	MMapIOStream(int fd, uint64_t offset, const rawz_io_options &options) try :
+		m_fd{ fd },
+		m_map{ MAP_FAILED },
+		m_map_size{},
+		m_data{},
+		m_offset{ offset },
+		m_length{},
+		m_where{}
+	{
+		struct stat st{};
+		if (fstat(m_fd, &st))
+			throw_system_error();
+
+		uint64_t file_size = st.st_size;
+		if (offset > file_size)
+			throw std::runtime_error{ "offset past end of file" };
 
-		// Check for overflow.
-		if (offset >= 0) {
-			if (new_address < base_address)
-				throw_error();
-		} else {
-			if (new_address > base_address)
-				throw_error();
+		// Mappings must start on a page boundary.
+		uint64_t page_size = sysconf(_SC_PAGESIZE);
+		uint64_t map_offset = offset - offset % page_size;
+
+		if (file_size - map_offset > SIZE_MAX)
+			throw std::runtime_error{ "file too large to map" };
+
+		m_map_size = static_cast<size_t>(file_size - map_offset);
+		m_length = file_size - offset;
+
+		// Zero-length mappings are not allowed.
+		if (!m_map_size)
+			return;
+
+		int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+		if (options.populate)
+			flags |= MAP_POPULATE;
+#endif
+		m_map = mmap(nullptr, m_map_size, PROT_READ, flags, m_fd, static_cast<off_t>(map_offset));
+		if (m_map == MAP_FAILED)
+			throw_system_error();
+
+		m_data = static_cast<const unsigned char *>(m_map) + (offset - map_offset);
+		apply_advice(options);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+
+	MMapIOStream(const MMapIOStream &) = delete;
+
+	~MMapIOStream()
+	{
+		if (m_map != MAP_FAILED)
+			munmap(m_map, m_map_size);
+		close(m_fd);
+	}
+
+	MMapIOStream &operator=(const MMapIOStream &) = delete;
+
+	bool seekable() const override { return true; }
+
+	void read(void *buf, size_t n) override
+	{
+		uint64_t avail = m_where < m_length ? m_length - m_where : 0;
+
+		if (n > avail) {
+			if (avail)
+				std::memcpy(buf, m_data + m_where, static_cast<size_t>(avail));
+			m_where += avail;
+			throw eof{};
 		}
 
-		if (new_address > static_cast<uint64_t>(INT64_MAX))
-			throw_error();
+		std::memcpy(buf, m_data + m_where, n);
+		m_where += n;
+	}
+
+	void seek(int64_t offset, int whence) override
+	{
+		m_where = seek_address(offset, whence, 0, m_where, m_length);
+	}
+
+	uint64_t tell() const override { return m_where; }
+
+	uint64_t length() const override { return m_length; }
+
+	const void *data() const noexcept override { return m_data; }
+
+	void advise(uint64_t offset, uint64_t n, Advice advice) noexcept override
+	{
+		if (offset > m_length)
+			return;
+		n = std::min(n, m_length - offset);
+
+#ifdef MADV_DONTNEED
+		// Pages mapped by this process are not evicted by fadvise, so unmap whole pages first.
+		if (advice == Advice::dontneed) {
+			uintptr_t page_size = sysconf(_SC_PAGESIZE);
+			uintptr_t first = reinterpret_cast<uintptr_t>(m_data + offset);
+			uintptr_t last = reinterpret_cast<uintptr_t>(m_data + offset + n);
+
+			first = (first + page_size - 1) / page_size * page_size;
+			last = last / page_size * page_size;
+
+			if (first < last)
+				madvise(reinterpret_cast<void *>(first), last - first, MADV_DONTNEED);
+		}
+#endif
+		fadvise_range(m_fd, m_offset + offset, n, advice);
+	}
+
+	bool is_hole(uint64_t offset, uint64_t n) noexcept override
+	{
+		return offset <= m_length && n <= m_length - offset && is_hole_range(m_fd, m_offset + offset, n);
+	}
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		m_read_requests += count;
+
+		for (size_t i = 0; i < count; ++i) {
+			if (req[i].offset > m_length || req[i].n > m_length - req[i].offset)
+				throw eof{};
+			std::memcpy(req[i].buf, m_data + req[i].offset, req[i].n);
+		}
+	}
+};
+
+// Bypasses the page cache. Reads are issued in whole blocks, into the destination if it is aligned, or into an aligned
+// staging buffer. Positional reads stage through buffers from a pool, so that threads do not share a buffer.
+class DirectIOStream : public IOStream {
+	// Conservative logical block size. Covers 512e and 4Kn devices.
+	static constexpr size_t block_size = 4096;
+	static constexpr size_t default_buffer_size = 4UL << 20;
+	static constexpr size_t max_buffer_size = 64UL << 20;
+
+	struct FreeDeleter {
+		void operator()(void *ptr) { std::free(ptr); }
+	};
+
+	int m_fd;
+	std::unique_ptr<unsigned char, FreeDeleter> m_buffer; // Used by the stream cursor.
+	size_t m_buffer_size;
+	uint64_t m_buffer_pos;
+	size_t m_buffer_count;
+	uint64_t m_offset;
+	uint64_t m_length;
+	uint64_t m_where;
+	StagingPool m_staging;
+
+	static bool is_aligned(const void *ptr) { return reinterpret_cast<uintptr_t>(ptr) % block_size == 0; }
+
+	// Reads whole blocks from an aligned position into an aligned buffer. Returns the number of bytes read, which is
+	// less than n only at the end of the file.
+	size_t read_blocks(unsigned char *buf, uint64_t pos, size_t n)
+	{
+		size_t count = 0;
+
+		while (count < n) {
+			++m_read_calls;
+			ssize_t res = pread(m_fd, buf + count, n - count, static_cast<off_t>(pos + count));
+			if (res < 0 && errno == EINTR)
+				continue;
+			if (res < 0)
+				throw_system_error();
+			if (res == 0)
+				break;
+
+			count += static_cast<size_t>(res);
+
+			// A partial block can only occur at the end of the file.
+			if (count % block_size)
+				break;
+		}
+
+		return count;
+	}
+
+	void fill(uint64_t pos)
+	{
+		uint64_t start = pos - pos % block_size;
+
+		m_buffer_count = 0;
+		m_buffer_count = read_blocks(m_buffer.get(), start, m_buffer_size);
+		m_buffer_pos = start;
+	}
+
+	// Reads n bytes at an absolute position, which the caller has checked against the file length.
+	unsigned char *aligned_staging(std::optional<StagingBuffer> &staging, size_t size)
+	{
+		// Pool buffers are only 64-byte aligned, so one more block is reserved for alignment.
+		if (!staging || staging->capacity() < size + block_size) {
+			staging.reset();
+			staging.emplace(m_staging.acquire(size + block_size));
+		}
+
+		return staging->data() + (block_size - reinterpret_cast<uintptr_t>(staging->data()) % block_size) % block_size;
+	}
+
+	// Reads the blocks of a merged request at once and copies out its pieces.
+	void read_pieces(const IORequest &merged, const IORequest *pieces, size_t count, std::optional<StagingBuffer> &staging)
+	{
+		uint64_t pos = m_offset + merged.offset;
+		uint64_t start = pos - pos % block_size;
+		size_t lead = static_cast<size_t>(pos - start);
+		size_t span = (lead + merged.n + (block_size - 1)) / block_size * block_size;
+		unsigned char *buf = aligned_staging(staging, span);
+
+		if (read_blocks(buf, start, span) < lead + merged.n)
+			throw eof{};
+
+		for (size_t k = 0; k < count; ++k) {
+			std::memcpy(pieces[k].buf, buf + lead + (pieces[k].offset - merged.offset), pieces[k].n);
+		}
+	}
+
+	void read_range(uint64_t pos, unsigned char *dst, size_t n, std::optional<StagingBuffer> &staging)
+	{
+		// Whole blocks go straight to an aligned destination.
+		if (pos % block_size == 0 && is_aligned(dst) && n >= block_size) {
+			size_t count = n - n % block_size;
+			if (read_blocks(dst, pos, count) != count)
+				throw eof{};
+
+			pos += count;
+			dst += count;
+			n -= count;
+		}
+
+		// The rest is read in spans of at most one buffer, covering only the blocks of the request.
+		while (n) {
+			uint64_t start = pos - pos % block_size;
+			size_t lead = static_cast<size_t>(pos - start);
+			size_t span = std::min(lead + n + (block_size - 1), m_buffer_size + (block_size - 1)) / block_size * block_size;
+			unsigned char *buf = aligned_staging(staging, span);
+			size_t count = std::min(n, span - lead);
+
+			if (read_blocks(buf, start, span) < lead + count)
+				throw eof{};
 
-		if (fseeko(m_file.get(), new_address, SEEK_SET)) {
-			m_valid_pos = false;
+			std::memcpy(dst, buf + lead, count);
+			pos += count;
+			dst += count;
+			n -= count;
+		}
+	}
+public:
+	DirectIOStream(int fd, uint64_t offset, const rawz_io_options &options) try :
+		m_fd{ fd },
+		m_buffer_size{},
+		m_buffer_pos{},
+		m_buffer_count{},
+		m_offset{ offset },
+		m_length{},
+		m_where{ offset }
+	{
+		struct stat st{};
+		if (fstat(m_fd, &st))
 			throw_system_error();
+
+		m_length = st.st_size;
+		if (m_offset > m_length)
+			throw std::runtime_error{ "offset past end of file" };
+
+		size_t buffer_size = options.buffer_size ? options.buffer_size : default_buffer_size;
+		buffer_size = std::min(std::max(buffer_size, block_size), max_buffer_size);
+		m_buffer_size = (buffer_size + block_size - 1) / block_size * block_size;
+
+		void *ptr = nullptr;
+		if (posix_memalign(&ptr, block_size, m_buffer_size))
+			throw std::bad_alloc{};
+		m_buffer.reset(static_cast<unsigned char *>(ptr));
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+
+	DirectIOStream(const DirectIOStream &) = delete;
+
+	~DirectIOStream() { close(m_fd); }
+
+	DirectIOStream &operator=(const DirectIOStream &) = delete;
+
+	bool seekable() const override { return true; }
+
+	void read(void *buf, size_t n) override
+	{
+		unsigned char *buf_p = static_cast<unsigned char *>(buf);
+
+		while (n) {
+			if (m_where < m_buffer_pos || m_where - m_buffer_pos >= m_buffer_count) {
+				fill(m_where);
+				if (m_where - m_buffer_pos >= m_buffer_count)
+					throw eof{};
+			}
+
+			size_t buffer_offset = static_cast<size_t>(m_where - m_buffer_pos);
+			size_t count = std::min(n, m_buffer_count - buffer_offset);
+			std::memcpy(buf_p, m_buffer.get() + buffer_offset, count);
+
+			buf_p += count;
+			m_where += count;
+			n -= count;
 		}
-		m_where = new_address;
 	}
 
-	uint64_t tell() const override
+	void seek(int64_t offset, int whence) override
 	{
-		if (!m_valid_pos)
-			do_tell();
-		if (m_where < m_offset)
-			throw std::runtime_error{ "invalid file position" };
-		return m_where - m_offset;
+		// Deferred until the next read, which will reuse the staging buffer if possible.
+		m_where = seek_address(offset, whence, m_offset, m_where, m_length);
 	}
 
+	uint64_t tell() const override { return m_where - m_offset; }
+
 	uint64_t length() const override { return m_length - m_offset; }
+
+	void refresh() override
+	{
+		struct stat st{};
+		if (fstat(m_fd, &st))
+			throw_system_error();
+		m_length = st.st_size;
+	}
+
+	// Only relevant if the file system does not support O_DIRECT.
+	void advise(uint64_t offset, uint64_t n, Advice advice) noexcept override
+	{
+		if (offset <= m_length - m_offset)
+			fadvise_range(m_fd, m_offset + offset, n, advice);
+	}
+
+	bool is_hole(uint64_t offset, uint64_t n) noexcept override
+	{
+		return offset <= m_length - m_offset && n <= m_length - m_offset - offset && is_hole_range(m_fd, m_offset + offset, n);
+	}
+
+	bool file_id(uint64_t &device, uint64_t &inode) const noexcept override { return fd_file_id(m_fd, device, inode); }
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		CoalescedBatch batch{ req, count, nullptr };
+		std::optional<StagingBuffer> staging;
+
+		m_read_requests += count;
+
+		for (size_t i = 0; i < batch.size(); ++i) {
+			const IORequest &cur = batch.data()[i];
+			size_t piece_count;
+			const IORequest *pieces = batch.pieces(i, piece_count);
+
+			if (cur.offset > m_length - m_offset || cur.n > m_length - m_offset - cur.offset)
+				throw eof{};
+
+			if (pieces)
+				read_pieces(cur, pieces, piece_count, staging);
+			else
+				read_range(m_offset + cur.offset, static_cast<unsigned char *>(cur.buf), cur.n, staging);
+		}
+	}
 };
 
+// Returns false if the file system does not support unbuffered I/O.
+bool enable_direct_io(int fd)
+{
+#if defined(O_DIRECT)
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		throw_system_error();
+	return !fcntl(fd, F_SETFL, flags | O_DIRECT);
+#elif defined(F_NOCACHE)
+	return !fcntl(fd, F_NOCACHE, 1);
+#else
+	return false;
+#endif
+}
+#endif // _WIN32
+
 
 class UserIOStream : public IOStream {
 	rawz_io_user_read m_read;
@@ -205,6 +748,7 @@ class UserIOStream : public IOStream {
 	rawz_io_user_tell m_tell;
 	rawz_io_user_close m_close;
 	uint64_t m_length;
+	uint64_t m_where;
 	void *m_user;
 public:
 	UserIOStream(rawz_io_user_read read, rawz_io_user_seek seek, rawz_io_user_tell tell, rawz_io_user_close close,
@@ -214,6 +758,7 @@ public:
 		m_tell{ tell },
 		m_close{ close },
 		m_length{ seek ? static_cast<uint64_t>(length) : 0 },
+		m_where{},
 		m_user{ user }
 	{}
 
@@ -227,12 +772,15 @@ public:
 
 	void read(void *buf, size_t n) override
 	{
+		++m_read_calls;
 		int res = m_read(buf, n, m_user);
 
 		if (res < 0)
 			throw std::runtime_error{ "user read error" };
 		else if (res > 0)
 			throw eof{};
+
+		m_where += n;
 	}
 
 	void seek(int64_t offset, int whence) override
@@ -245,6 +793,10 @@ public:
 	{
 		int64_t pos;
 
+		// Non-seekable streams report the number of bytes consumed.
+		if (!m_tell)
+			return m_where;
+
 		if ((pos = m_tell(m_user)) < 0)
 			throw std::runtime_error{ "user tell error" };
 
@@ -254,17 +806,155 @@ public:
 	uint64_t length() const override { return m_length; }
 };
 
+
+// Positional user I/O. Each batch is passed to the callback in one call.
+class UserBatchIOStream : public IOStream {
+	rawz_io_user_read_batch m_read_batch;
+	rawz_io_user_close m_close;
+	uint64_t m_length;
+	uint64_t m_where;
+	void *m_user;
+public:
+	UserBatchIOStream(rawz_io_user_read_batch read_batch, rawz_io_user_close close, int64_t length, void *user) :
+		m_read_batch{ read_batch },
+		m_close{ close },
+		m_length{},
+		m_where{},
+		m_user{ user }
+	{
+		if (length < 0)
+			throw std::runtime_error{ "invalid length" };
+		m_length = length;
+	}
+
+	UserBatchIOStream(const UserBatchIOStream &) = delete;
+
+	~UserBatchIOStream() { if (m_close) m_close(m_user); }
+
+	UserBatchIOStream &operator=(const UserBatchIOStream &) = delete;
+
+	bool seekable() const override { return true; }
+
+	void read(void *buf, size_t n) override
+	{
+		read_at(m_where, buf, n);
+		m_where += n;
+	}
+
+	void seek(int64_t offset, int whence) override
+	{
+		m_where = seek_address(offset, whence, 0, m_where, m_length);
+	}
+
+	uint64_t tell() const override { return m_where; }
+
+	uint64_t length() const override { return m_length; }
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		if (!count)
+			return;
+
+		std::vector<rawz_io_request> user_req(count);
+		for (size_t i = 0; i < count; ++i) {
+			user_req[i] = { req[i].offset, req[i].buf, req[i].n };
+		}
+
+		m_read_requests += count;
+		++m_read_calls;
+		int res = m_read_batch(user_req.data(), user_req.size(), m_user);
+
+		if (res < 0)
+			throw std::runtime_error{ "user read error" };
+		else if (res > 0)
+			throw eof{};
+	}
+};
+
+std::unique_ptr<IOStream> apply_options(std::unique_ptr<IOStream> stream, uint64_t offset, const rawz_io_options &options)
+{
+	stream = create_parallel_stream(std::move(stream), options.parallel_range_size, options.parallel_threads);
+	if (options.scheduled)
+		stream = create_scheduled_stream(std::move(stream));
+
+	// Limits apply to the bytes read from storage.
+	if (options.max_bytes_per_sec || options.max_iops || process_limits_enabled())
+		stream = create_throttle_stream(std::move(stream), options.max_bytes_per_sec, options.max_iops, true);
+
+	// The seek table is at the end of the file, so compressed files can neither grow nor be read sequentially.
+	if (options.compressed)
+		return create_decompress_stream(std::move(stream), offset, options);
+	if (stream->seekable() && options.follow)
+		return create_follow_stream(std::move(stream), options.follow_timeout);
+	if (!stream->seekable() && (options.backseek_bytes || options.backseek_spill_bytes))
+		return create_backseek_stream(std::move(stream), options.backseek_bytes, options.backseek_spill_bytes);
+
+	return stream;
+}
+
+// The backend reads a compressed file from the beginning.
+uint64_t backend_offset(uint64_t offset, const rawz_io_options &options)
+{
+	return options.compressed ? 0 : offset;
+}
+
+// Memory-mapped files can not grow.
+rawz_io_mode effective_mode(const rawz_io_options &options)
+{
+	return options.follow && options.mode == RAWZ_IO_MMAP ? RAWZ_IO_STDIO : options.mode;
+}
+
 } // namespace
 
 
+uint64_t seek_address(int64_t offset, int whence, uint64_t set, uint64_t cur, uint64_t end)
+{
+	static_assert(~int64_t(0) == int64_t(-1), "twos complement");
+
+	auto throw_error = []() { throw std::runtime_error{ "offset out of bounds" }; };
+
+	uint64_t base_address = 0;
+	switch (whence) {
+	case IOStream::seek_set:
+		base_address = set;
+		break;
+	case IOStream::seek_cur:
+		base_address = cur;
+		break;
+	case IOStream::seek_end:
+		base_address = end;
+		break;
+	default:
+		throw std::logic_error{ "invalid seek mode" };
+	}
+
+	uint64_t new_address = base_address + static_cast<uint64_t>(offset);
+
+	// Check for overflow.
+	if (offset >= 0) {
+		if (new_address < base_address)
+			throw_error();
+	} else {
+		if (new_address > base_address)
+			throw_error();
+	}
+
+	if (new_address > static_cast<uint64_t>(INT64_MAX))
+		throw_error();
+
+	return new_address;
+}
+
+
 void IOStream::skip(size_t n)
 {
 	constexpr size_t thresh = 4096;
 
 	if (n >= thresh && seekable()) {
 		while (n) {
-			int64_t count = std::min(static_cast<uint64_t>(n), static_cast<uint64_t>(INT64_MAX));
-			seek(static_cast<int64_t>(n), seek_cur);
+			int64_t count = static_cast<int64_t>(std::min(static_cast<uint64_t>(n), static_cast<uint64_t>(INT64_MAX)));
+			seek(count, seek_cur);
+			n -= static_cast<size_t>(count);
 		}
 	} else {
 		char buf[4096];
@@ -278,39 +968,379 @@ void IOStream::skip(size_t n)
 }
 
 
-void seek_to_frame(IOStream *io, int64_t &cur_frame, int64_t n, uint64_t packet_size, uint64_t base_offset) try
+void IOStream::read_batch_cursor(const IORequest *req, size_t count)
 {
-	if (cur_frame == n)
+	constexpr uint64_t thresh = 4096;
+
+	if (!count)
 		return;
-	if (cur_frame == INT64_MAX)
-		throw IOStream::eof{};
+
+	CoalescedBatch batch{ req, count, &coalesce_pool() };
+	m_read_requests += count;
+
+	std::lock_guard<std::mutex> lock{ m_cursor_mutex };
+	uint64_t pos = tell();
+
+	for (size_t i = 0; i < batch.size(); ++i) {
+		const IORequest &cur = batch.data()[i];
+		uint64_t offset = cur.offset;
+
+		// Avoid seeking over small gaps between batches.
+		if (offset > pos && (offset - pos < thresh || !seekable())) {
+			if (offset - pos > SIZE_MAX)
+				throw std::runtime_error{ "offset out of bounds" };
+			skip(static_cast<size_t>(offset - pos));
+		} else if (offset != pos) {
+			if (offset > static_cast<uint64_t>(INT64_MAX))
+				throw eof{};
+			seek(static_cast<int64_t>(offset), seek_set);
+		}
+
+		read(cur.buf, cur.n);
+		batch.scatter(i);
+		pos = offset + cur.n;
+	}
+}
+
+void IOStream::read_at(uint64_t offset, void *buf, size_t n)
+{
+	IORequest req{ offset, buf, n };
+	read_batch(&req, 1);
+}
+
+void IOStream::read_batch(const IORequest *req, size_t count)
+{
+	read_batch_cursor(req, count);
+}
+
+rawz_stream_stats IOStream::stats() const noexcept
+{
+	rawz_stream_stats stats{};
+	stats.read_requests = m_read_requests;
+	stats.read_calls = m_read_calls;
+	return stats;
+}
+
+void add_stats(rawz_stream_stats &stats, const rawz_stream_stats &other) noexcept
+{
+	stats.read_requests += other.read_requests;
+	stats.read_calls += other.read_calls;
+	stats.throttled_reads += other.throttled_reads;
+	stats.throttle_delay_us += other.throttle_delay_us;
+}
+
+
+CoalescedBatch::CoalescedBatch(const IORequest *req, size_t count, StagingPool *pool)
+{
+	// Merged requests, and therefore the staging buffer, are limited to max_span.
+	constexpr uint64_t max_span = 4UL << 20;
+
+	struct Group {
+		uint64_t begin;
+		uint64_t end;
+		size_t first;
+		size_t last;
+		bool contiguous; // Adjacent in the file and in memory.
+	};
+
+	std::vector<size_t> order;
+	for (size_t i = 0; i < count; ++i) {
+		if (!req[i].n)
+			continue;
+		if (req[i].n > UINT64_MAX - req[i].offset)
+			throw IOStream::eof{};
+		order.push_back(i);
+	}
+	std::stable_sort(order.begin(), order.end(), [=](size_t a, size_t b) { return req[a].offset < req[b].offset; });
+
+	std::vector<Group> groups;
+	size_t staging_size = 0;
+
+	for (size_t k = 0; k < order.size(); ++k) {
+		const IORequest &cur = req[order[k]];
+		uint64_t end = cur.offset + cur.n;
+
+		if (!groups.empty()) {
+			Group &group = groups.back();
+			const IORequest &prev = req[order[k - 1]];
+			uint64_t new_end = std::max(group.end, end);
+
+			if (cur.offset - std::min(cur.offset, group.end) <= max_gap && new_end - group.begin <= max_span) {
+				group.contiguous = group.contiguous && cur.offset == group.end && cur.buf == static_cast<unsigned char *>(prev.buf) + prev.n;
+				group.end = new_end;
+				group.last = k + 1;
+				continue;
+			}
+		}
+
+		groups.push_back({ cur.offset, end, k, k + 1, true });
+	}
+
+	for (const Group &group : groups) {
+		if (!group.contiguous)
+			staging_size = std::max(staging_size, static_cast<size_t>(group.end - group.begin));
+	}
+	if (staging_size && pool)
+		m_staging.emplace(pool->acquire(staging_size));
+
+	m_first_piece.push_back(0);
+
+	for (const Group &group : groups) {
+		size_t span = static_cast<size_t>(group.end - group.begin);
+
+		if (group.contiguous) {
+			m_requests.push_back({ group.begin, req[order[group.first]].buf, span });
+		} else {
+			m_requests.push_back({ group.begin, m_staging ? m_staging->data() : nullptr, span });
+
+			for (size_t k = group.first; k < group.last; ++k) {
+				m_pieces.push_back(req[order[k]]);
+			}
+		}
+
+		m_first_piece.push_back(m_pieces.size());
+	}
+}
+
+void CoalescedBatch::scatter(size_t i) const
+{
+	const IORequest &merged = m_requests[i];
+
+	for (size_t k = m_first_piece[i]; k < m_first_piece[i + 1]; ++k) {
+		const IORequest &cur = m_pieces[k];
+		std::memcpy(cur.buf, static_cast<const unsigned char *>(merged.buf) + (cur.offset - merged.offset), cur.n);
+	}
+}
+
+
+void throw_system_error(int err)
+{
+	throw std::system_error{ err, std::generic_category() };
+}
+
+#ifndef _WIN32
+bool is_regular_file(int fd)
+{
+	struct stat st{};
+	if (fstat(fd, &st))
+		throw_system_error();
+	return S_ISREG(st.st_mode);
+}
+
+size_t pread_full(int fd, void *buf, size_t n, uint64_t offset)
+{
+	unsigned char *buf_p = static_cast<unsigned char *>(buf);
+	size_t count = 0;
+
+	while (count < n) {
+		ssize_t res = pread(fd, buf_p + count, n - count, static_cast<off_t>(offset + count));
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0)
+			throw_system_error();
+		if (res == 0)
+			break;
+
+		count += static_cast<size_t>(res);
+	}
+
+	return count;
+}
+
+void fadvise_range(int fd, uint64_t offset, uint64_t n, IOStream::Advice advice) noexcept
+{
+#ifdef POSIX_FADV_DONTNEED
+	if (!n || offset > static_cast<uint64_t>(INT64_MAX) || n > static_cast<uint64_t>(INT64_MAX) - offset)
+		return;
+
+	int flag = advice == IOStream::Advice::dontneed ? POSIX_FADV_DONTNEED : POSIX_FADV_WILLNEED;
+	posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(n), flag);
+#endif
+}
+
+bool is_hole_range(int fd, uint64_t offset, uint64_t n) noexcept
+{
+#ifdef SEEK_DATA
+	if (!n || offset > static_cast<uint64_t>(INT64_MAX) || n > static_cast<uint64_t>(INT64_MAX) - offset)
+		return false;
+
+	// The file is not scanned in advance, since capture programs fill holes after the file was opened.
+	off_t data = lseek(fd, static_cast<off_t>(offset), SEEK_DATA);
+	if (data < 0)
+		return errno == ENXIO;
+	return static_cast<uint64_t>(data) >= offset + n;
+#else
+	return false;
+#endif
+}
+
+bool fd_file_id(int fd, uint64_t &device, uint64_t &inode) noexcept
+{
+	struct stat st{};
+	if (fstat(fd, &st))
+		return false;
+
+	device = st.st_dev;
+	inode = st.st_ino;
+	return true;
+}
+#endif
+
+
+uint64_t frame_offset(int64_t n, uint64_t packet_size, uint64_t base_offset)
+{
 	if (n < 0)
 		throw IOStream::eof{};
 	if (static_cast<uint64_t>(n) > (static_cast<uint64_t>(INT64_MAX) - base_offset) / packet_size)
 		throw IOStream::eof{};
 
-	uint64_t where = base_offset + static_cast<uint64_t>(n) * packet_size;
-	io->seek(where, IOStream::seek_set);
-	cur_frame = n;
-} catch (...) {
-	cur_frame = -1;
-	throw;
+	return base_offset + static_cast<uint64_t>(n) * packet_size;
+}
+
+std::unique_ptr<IOStream> create_stdio_stream(const char *path, bool seekable, uint64_t offset, const rawz_io_options &options)
+{
+	return create_stdio_stream_fd(unicode_open(path), seekable, offset, options);
+}
+
+std::unique_ptr<IOStream> create_stdio_stream_fd(int fd, bool seekable, uint64_t offset, const rawz_io_options &options)
+{
+	return std::make_unique<FileIOStream>(fd, seekable, offset, options);
+}
+
+std::unique_ptr<IOStream> create_mmap_stream(const char *path, bool seekable, uint64_t offset, const rawz_io_options &options)
+{
+#ifdef _WIN32
+	return create_stdio_stream(path, seekable, offset, options);
+#else
+	if (!seekable)
+		return create_stdio_stream(path, seekable, offset, options);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw_system_error();
+
+	return create_mmap_stream_fd(fd, seekable, offset, options);
+#endif
+}
+
+std::unique_ptr<IOStream> create_mmap_stream_fd(int fd, bool seekable, uint64_t offset, const rawz_io_options &options)
+{
+#ifdef _WIN32
+	return create_stdio_stream_fd(fd, seekable, offset, options);
+#else
+	if (!seekable || !is_regular_file(fd))
+		return create_stdio_stream_fd(fd, seekable, offset, options);
+
+	return std::make_unique<MMapIOStream>(fd, offset, options);
+#endif
+}
+
+std::unique_ptr<IOStream> create_direct_stream(const char *path, bool seekable, uint64_t offset, const rawz_io_options &options)
+{
+#ifdef _WIN32
+	return create_stdio_stream(path, seekable, offset, options);
+#else
+	if (!seekable)
+		return create_stdio_stream(path, seekable, offset, options);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw_system_error();
+
+	return create_direct_stream_fd(fd, seekable, offset, options);
+#endif
+}
+
+std::unique_ptr<IOStream> create_direct_stream_fd(int fd, bool seekable, uint64_t offset, const rawz_io_options &options)
+{
+#ifdef _WIN32
+	return create_stdio_stream_fd(fd, seekable, offset, options);
+#else
+	if (!seekable || !is_regular_file(fd))
+		return create_stdio_stream_fd(fd, seekable, offset, options);
+
+	// Otherwise, reads would silently go through the page cache.
+	try {
+		if (!enable_direct_io(fd))
+			throw std::runtime_error{ "file system does not support direct I/O" };
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+
+	return std::make_unique<DirectIOStream>(fd, offset, options);
+#endif
 }
 
+std::unique_ptr<IOStream> create_backend_stream(const char *path, bool seekable, uint64_t offset, const rawz_io_options &options)
+{
+	switch (effective_mode(options)) {
+	case RAWZ_IO_STDIO:
+		return create_stdio_stream(path, seekable, offset, options);
+	case RAWZ_IO_MMAP:
+		return create_mmap_stream(path, seekable, offset, options);
+	case RAWZ_IO_DIRECT:
+		return create_direct_stream(path, seekable, offset, options);
+	case RAWZ_IO_ASYNC:
+		return create_async_stream(path, seekable, offset, options);
+	default:
+		throw std::runtime_error{ "unsupported I/O mode" };
+	}
+}
 
-std::unique_ptr<IOStream> create_stdio_stream(const char *path, bool seekable, uint64_t offset)
+std::unique_ptr<IOStream> create_file_stream(const char *path, bool seekable, uint64_t offset, const rawz_io_options &options)
 {
-	return std::make_unique<FileIOStream>(unicode_open(path, WSTR("rb")), seekable, offset);
+	std::unique_ptr<IOStream> stream;
+	uint64_t raw_offset = backend_offset(offset, options);
+
+	if (seekable && options.lazy_open)
+		stream = create_lazy_stream(path, raw_offset, options);
+	else
+		stream = create_backend_stream(path, seekable, raw_offset, options);
+
+	return apply_options(std::move(stream), offset, options);
 }
 
-std::unique_ptr<IOStream> create_stdio_stream_fd(int fd, bool seekable, uint64_t offset)
+std::unique_ptr<IOStream> create_file_stream_fd(int fd, bool seekable, uint64_t offset, const rawz_io_options &options)
 {
-	return std::make_unique<FileIOStream>(unique_file{ fdopen(fd, "rb") }, seekable, offset);
+	std::unique_ptr<IOStream> stream;
+	uint64_t raw_offset = backend_offset(offset, options);
+
+	switch (effective_mode(options)) {
+	case RAWZ_IO_STDIO:
+		stream = create_stdio_stream_fd(fd, seekable, raw_offset, options);
+		break;
+	case RAWZ_IO_MMAP:
+		stream = create_mmap_stream_fd(fd, seekable, raw_offset, options);
+		break;
+	case RAWZ_IO_DIRECT:
+		stream = create_direct_stream_fd(fd, seekable, raw_offset, options);
+		break;
+	case RAWZ_IO_ASYNC:
+		stream = create_async_stream_fd(fd, seekable, raw_offset, options);
+		break;
+	default:
+		throw std::runtime_error{ "unsupported I/O mode" };
+	}
+
+	return apply_options(std::move(stream), offset, options);
 }
 
 std::unique_ptr<IOStream> create_user_stream(rawz_io_user_read read, rawz_io_user_seek seek, rawz_io_user_tell tell, rawz_io_user_close close,
                                              int64_t length, void *user)
 {
-	return std::make_unique<UserIOStream>(read, seek, tell, close, length, user);
+	std::unique_ptr<IOStream> stream = std::make_unique<UserIOStream>(read, seek, tell, close, length, user);
+	if (process_limits_enabled())
+		stream = create_throttle_stream(std::move(stream), 0, 0, true);
+	return stream;
 }
+
+std::unique_ptr<IOStream> create_user_batch_stream(rawz_io_user_read_batch read_batch, rawz_io_user_close close, int64_t length, void *user)
+{
+	std::unique_ptr<IOStream> stream = std::make_unique<UserBatchIOStream>(read_batch, close, length, user);
+	if (process_limits_enabled())
+		stream = create_throttle_stream(std::move(stream), 0, 0, true);
+	return stream;
+}
+
 } // namespace rawz
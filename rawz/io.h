@@ -3,20 +3,48 @@
 #ifndef RAWZ_IO_H_
 #define RAWZ_IO_H_
 
+#include <atomic>
+#include <cerrno>
 #include <cstdint>
 #include <exception>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
 #include "rawz.h"
+#include "staging.h"
 
 struct rawz_io_stream {
 protected:
 	~rawz_io_stream() = default;
 };
 
+struct rawz_shm_producer {
+protected:
+	~rawz_shm_producer() = default;
+};
+
 
 namespace rawz {
 
+struct IORequest {
+	uint64_t offset;
+	void *buf;
+	size_t n;
+};
+
+
 class IOStream : public rawz_io_stream {
+protected:
+	// Serializes positional reads emulated with the stream cursor.
+	std::mutex m_cursor_mutex;
+
+	// Byte ranges requested from the backend, and the reads or callbacks issued to serve them.
+	std::atomic<uint64_t> m_read_requests{};
+	std::atomic<uint64_t> m_read_calls{};
+
+	void read_batch_cursor(const IORequest *req, size_t count);
 public:
 	struct eof : public std::exception {
 		const char *what() const noexcept override { return "eof"; }
@@ -26,6 +54,11 @@ public:
 	static constexpr int seek_cur = 1;
 	static constexpr int seek_end = 2;
 
+	enum class Advice {
+		willneed,
+		dontneed,
+	};
+
 	virtual ~IOStream() = default;
 
 	IOStream &operator=(IOStream &) = delete;
@@ -42,6 +75,35 @@ public:
 
 	virtual void skip(size_t n);
 
+	// Updates length() if the file has grown. Not thread-safe.
+	virtual void refresh() {}
+
+	// Reads from an offset relative to the beginning of the stream. Thread-safe.
+	// The stream position is unspecified afterwards.
+	virtual void read_at(uint64_t offset, void *buf, size_t n);
+
+	// Reads a list of byte ranges. Same semantics as read_at. Requests may complete in any order.
+	virtual void read_batch(const IORequest *req, size_t count);
+
+	// Hints the expected use of a byte range to the page cache. Errors are ignored.
+	virtual void advise(uint64_t /*offset*/, uint64_t /*n*/, Advice /*advice*/) noexcept {}
+
+	// Returns true if the byte range lies entirely in a hole of a sparse file, and therefore reads as zeros.
+	// Errors and unsupported file systems report false.
+	virtual bool is_hole(uint64_t /*offset*/, uint64_t /*n*/) noexcept { return false; }
+
+	// Identifies the underlying file, e.g. to order reads from several streams. Returns false if unknown.
+	virtual bool file_id(uint64_t & /*device*/, uint64_t & /*inode*/) const noexcept { return false; }
+
+	// Closes files that are reopened on demand, e.g. once the stream has been set up.
+	virtual void release() noexcept {}
+
+	// Returns the contents of the stream if memory-mapped, or nullptr.
+	virtual const void *data() const noexcept { return nullptr; }
+
+	// Read counters of the backend. Decorators report the stream they wrap.
+	virtual rawz_stream_stats stats() const noexcept;
+
 	template <class T>
 	void read(T &t) { read(&t, sizeof(t)); }
 
@@ -50,16 +112,158 @@ public:
 };
 
 
-// Helper function. Performs a seek if the stream is not positioned at frame n.
-void seek_to_frame(IOStream *io, int64_t &cur_frame, int64_t n, uint64_t packet_size, uint64_t base_offset=0);
+// Writer side of a shared memory ring buffer. Frames are written into slot() and made visible by publish().
+class ShmProducer : public rawz_shm_producer {
+public:
+	virtual ~ShmProducer() = default;
+
+	ShmProducer &operator=(const ShmProducer &) = delete;
+
+	virtual void *slot() = 0;
+
+	virtual void publish() = 0;
+};
+
+
+// Helper class. Merges requests separated by small gaps, such as scanline padding, so that a batch needs fewer reads.
+// Merged requests that are not contiguous in memory share one staging buffer from pool, so each must be copied out by
+// scatter() before the next one is read. Without a pool, their buffer is null, and they are read through pieces().
+class CoalescedBatch {
+	std::vector<IORequest> m_requests;
+	std::vector<size_t> m_first_piece; // Index into m_pieces for each request, and one past the last.
+	std::vector<IORequest> m_pieces; // Original requests of staged requests, sorted by offset.
+	std::optional<StagingBuffer> m_staging;
+public:
+	// Gaps up to this size are read and discarded.
+	static constexpr size_t max_gap = 4096;
+
+	CoalescedBatch(const IORequest *req, size_t count, StagingPool *pool);
+
+	const IORequest *data() const { return m_requests.data(); }
+
+	size_t size() const { return m_requests.size(); }
+
+	// Original requests of request i if it is staged, or nullptr.
+	const IORequest *pieces(size_t i, size_t &count) const
+	{
+		count = m_first_piece[i + 1] - m_first_piece[i];
+		return count ? m_pieces.data() + m_first_piece[i] : nullptr;
+	}
+
+	void scatter(size_t i) const;
+};
+
 
+// Helper function. Adds the I/O counters of other to stats, e.g. to report files that have been closed.
+void add_stats(rawz_stream_stats &stats, const rawz_stream_stats &other) noexcept;
 
-std::unique_ptr<IOStream> create_stdio_stream(const char *path, bool seekable, uint64_t offset);
+// Helper function. Computes the target of a seek. Positions are absolute.
+uint64_t seek_address(int64_t offset, int whence, uint64_t set, uint64_t cur, uint64_t end);
 
-std::unique_ptr<IOStream> create_stdio_stream_fd(int fd, bool seekable, uint64_t offset);
+// Helper function. Throws std::system_error for an errno value.
+[[noreturn]] void throw_system_error(int err = errno);
+
+#ifndef _WIN32
+// Helper function. Returns whether fd refers to a regular file, as opposed to a pipe or device.
+bool is_regular_file(int fd);
+
+// Helper function. Reads until n bytes have been read or end of file. Returns the number of bytes read.
+size_t pread_full(int fd, void *buf, size_t n, uint64_t offset);
+
+// Helper function. Applies page cache advice to a file range. Errors are ignored.
+void fadvise_range(int fd, uint64_t offset, uint64_t n, IOStream::Advice advice) noexcept;
+
+// Helper function. Queries SEEK_DATA to determine whether a file range contains no data. Changes the file offset.
+bool is_hole_range(int fd, uint64_t offset, uint64_t n) noexcept;
+
+// Helper function. Returns the device and inode number of a file. Returns false on error.
+bool fd_file_id(int fd, uint64_t &device, uint64_t &inode) noexcept;
+#endif
+
+// Helper function. Computes the offset of frame n. Throws IOStream::eof on overflow.
+uint64_t frame_offset(int64_t n, uint64_t packet_size, uint64_t base_offset = 0);
+
+
+// Buffered reads from a file descriptor. The buffer size is options.buffer_size, between 64 KiB and 8 MiB.
+std::unique_ptr<IOStream> create_stdio_stream(const char *path, bool seekable, uint64_t offset, const rawz_io_options &options);
+
+std::unique_ptr<IOStream> create_stdio_stream_fd(int fd, bool seekable, uint64_t offset, const rawz_io_options &options);
+
+// Falls back to stdio if the file is not mappable.
+std::unique_ptr<IOStream> create_mmap_stream(const char *path, bool seekable, uint64_t offset, const rawz_io_options &options);
+
+std::unique_ptr<IOStream> create_mmap_stream_fd(int fd, bool seekable, uint64_t offset, const rawz_io_options &options);
+
+// Falls back to stdio if the file is not seekable, or to buffered reads if the file system does not support O_DIRECT.
+std::unique_ptr<IOStream> create_direct_stream(const char *path, bool seekable, uint64_t offset, const rawz_io_options &options);
+
+std::unique_ptr<IOStream> create_direct_stream_fd(int fd, bool seekable, uint64_t offset, const rawz_io_options &options);
+
+// Uses io_uring if available, or a thread pool otherwise. Falls back to stdio if the file is not seekable.
+std::unique_ptr<IOStream> create_async_stream(const char *path, bool seekable, uint64_t offset, const rawz_io_options &options);
+
+std::unique_ptr<IOStream> create_async_stream_fd(int fd, bool seekable, uint64_t offset, const rawz_io_options &options);
+
+// Selects the backend from options.mode. Other options are not applied.
+std::unique_ptr<IOStream> create_backend_stream(const char *path, bool seekable, uint64_t offset, const rawz_io_options &options);
+
+// Opens the backend on first access, and closes it again when more than the process-wide number of lazy files is open.
+// Zero-copy access to memory-mapped files is not available, since the mapping may go away.
+std::unique_ptr<IOStream> create_lazy_stream(const char *path, uint64_t offset, const rawz_io_options &options);
+
+// Limit on the files held open by lazy streams. Takes effect when the next file is opened. 0 = default
+void set_max_open_files(size_t count);
+
+// Delays reads to stay below bytes_per_sec and iops (0 = unlimited). Also applies the process-wide limits if process is true.
+std::unique_ptr<IOStream> create_throttle_stream(std::unique_ptr<IOStream> io, uint64_t bytes_per_sec, unsigned iops, bool process);
+
+// Queues positional reads to a process-wide scheduler, which dispatches the reads of all scheduled streams in file order.
+// Returns io unchanged if it is not a seekable file.
+std::unique_ptr<IOStream> create_scheduled_stream(std::unique_ptr<IOStream> io);
+
+// Splits batches larger than range_size (0 = default) into ranges read concurrently by threads threads.
+// Returns io unchanged if threads < 2 or io is not seekable. io must support concurrent positional reads.
+std::unique_ptr<IOStream> create_parallel_stream(std::unique_ptr<IOStream> io, size_t range_size, unsigned threads);
+
+// Limits shared by all streams created with process = true. 0 = unlimited
+void set_process_limits(uint64_t bytes_per_sec, unsigned iops);
+
+bool process_limits_enabled() noexcept;
+
+// Same as create_backend_stream, or create_lazy_stream if requested. Applies create_parallel_stream, create_scheduled_stream,
+// create_throttle_stream, create_decompress_stream, create_backseek_stream and create_follow_stream if requested.
+std::unique_ptr<IOStream> create_file_stream(const char *path, bool seekable, uint64_t offset, const rawz_io_options &options);
+
+std::unique_ptr<IOStream> create_file_stream_fd(int fd, bool seekable, uint64_t offset, const rawz_io_options &options);
+
+// Keeps the most recent window_bytes of a non-seekable stream in memory, and spill_bytes in a temporary file,
+// so that positional reads can go backwards within the larger of the two.
+std::unique_ptr<IOStream> create_backseek_stream(std::unique_ptr<IOStream> io, size_t window_bytes, uint64_t spill_bytes);
+
+// Waits for a growing file to reach the requested length. Throws IOStream::eof after timeout_ms (0 = default).
+std::unique_ptr<IOStream> create_follow_stream(std::unique_ptr<IOStream> io, unsigned timeout_ms);
+
+// Decompresses a seekable zstd file, or LZ4 frames followed by the same seek table. Offset is relative to the decompressed data.
+std::unique_ptr<IOStream> create_decompress_stream(std::unique_ptr<IOStream> io, uint64_t offset, const rawz_io_options &options);
+
+// Concatenates files into one stream. Files are opened on first access.
+std::unique_ptr<IOStream> create_segmented_stream(std::vector<std::string> paths, uint64_t offset, const rawz_io_options &options);
+
+// Attaches to a ring buffer created by create_shm_producer. Reads wait up to timeout_ms (0 = default) for a frame to be published.
+// Linux only.
+std::unique_ptr<IOStream> create_shm_stream(const char *name, unsigned timeout_ms);
+
+std::unique_ptr<IOStream> create_shm_stream_fd(int fd, unsigned timeout_ms);
+
+// Creates a ring buffer of slot_count frames in a POSIX shared memory object, or in a file descriptor such as a memfd.
+std::unique_ptr<ShmProducer> create_shm_producer(const char *name, uint64_t slot_size, unsigned slot_count);
+
+std::unique_ptr<ShmProducer> create_shm_producer_fd(int fd, uint64_t slot_size, unsigned slot_count);
 
 std::unique_ptr<IOStream> create_user_stream(rawz_io_user_read read, rawz_io_user_seek seek, rawz_io_user_tell tell, rawz_io_user_close close, int64_t length, void *user);
 
+std::unique_ptr<IOStream> create_user_batch_stream(rawz_io_user_read_batch read_batch, rawz_io_user_close close, int64_t length, void *user);
+
 } // namespace rawz
 
 #endif // RAWZ_IO_H_
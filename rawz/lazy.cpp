@@ -0,0 +1,253 @@
+#ifdef __GNUC__
+  #define _FILE_OFFSET_BITS 64
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "io.h"
+
+#ifdef _WIN32
+  #include <filesystem>
+#endif
+
+namespace rawz {
+
+namespace {
+
+constexpr size_t default_max_open_files = 128;
+
+
+class LazyIOStream;
+
+// Process-wide list of lazy streams holding an open file, most recently used first.
+struct OpenFiles {
+	std::mutex mutex;
+	std::list<LazyIOStream *> lru;
+	size_t max_open = default_max_open_files;
+};
+
+OpenFiles &open_files()
+{
+	static OpenFiles files;
+	return files;
+}
+
+
+// Opens the file on first access, and closes it when other streams need the descriptor. The length and identity of
+// the file are determined without opening it.
+class LazyIOStream : public IOStream {
+	std::string m_path;
+	rawz_io_options m_options;
+	uint64_t m_offset;
+	uint64_t m_length;
+	uint64_t m_where;
+	uint64_t m_device;
+	uint64_t m_inode;
+	bool m_has_id;
+
+	// Guarded by the mutex of open_files().
+	std::shared_ptr<IOStream> m_io;
+	std::list<LazyIOStream *>::iterator m_lru_pos;
+	rawz_stream_stats m_closed_stats; // Counters of previous opens.
+
+	void stat_path()
+	{
+#ifdef _WIN32
+		m_length = std::filesystem::file_size(std::filesystem::u8path(m_path));
+#else
+		struct stat st{};
+		if (stat(m_path.c_str(), &st))
+			throw std::system_error{ errno, std::generic_category(), m_path };
+		if (!S_ISREG(st.st_mode))
+			throw std::runtime_error{ "not a regular file: " + m_path };
+
+		m_length = st.st_size;
+		m_device = st.st_dev;
+		m_inode = st.st_ino;
+		m_has_id = true;
+#endif
+	}
+
+	// Closes the least recently used files over the limit. The caller destroys them after releasing the lock.
+	static void evict(OpenFiles &files, std::vector<std::shared_ptr<IOStream>> &closed)
+	{
+		while (files.lru.size() > files.max_open) {
+			LazyIOStream *victim = files.lru.back();
+			files.lru.pop_back();
+
+			// Readers in other threads keep their reference until they are done.
+			add_stats(victim->m_closed_stats, victim->m_io->stats());
+			closed.push_back(std::move(victim->m_io));
+		}
+	}
+
+	std::shared_ptr<IOStream> acquire()
+	{
+		OpenFiles &files = open_files();
+
+		{
+			std::lock_guard<std::mutex> lock{ files.mutex };
+			if (m_io) {
+				files.lru.splice(files.lru.begin(), files.lru, m_lru_pos);
+				return m_io;
+			}
+		}
+
+		// Opening may take long, e.g. to populate a mapping, so other streams are not blocked meanwhile.
+		std::shared_ptr<IOStream> io = create_backend_stream(m_path.c_str(), true, m_offset, m_options);
+		std::vector<std::shared_ptr<IOStream>> closed;
+		std::lock_guard<std::mutex> lock{ files.mutex };
+
+		if (m_io) {
+			files.lru.splice(files.lru.begin(), files.lru, m_lru_pos);
+			closed.push_back(std::move(io));
+			return m_io;
+		}
+
+		m_io = std::move(io);
+		files.lru.push_front(this);
+		m_lru_pos = files.lru.begin();
+		evict(files, closed);
+		return m_io;
+	}
+public:
+	LazyIOStream(const char *path, uint64_t offset, const rawz_io_options &options) :
+		m_path{ path },
+		m_options(options),
+		m_offset{ offset },
+		m_length{},
+		m_where{},
+		m_device{},
+		m_inode{},
+		m_has_id{},
+		m_closed_stats{}
+	{
+		stat_path();
+		if (m_offset > m_length)
+			throw std::runtime_error{ "offset past end of file" };
+	}
+
+	LazyIOStream(const LazyIOStream &) = delete;
+
+	~LazyIOStream() { release(); }
+
+	LazyIOStream &operator=(const LazyIOStream &) = delete;
+
+	bool seekable() const override { return true; }
+
+	void read(void *buf, size_t n) override
+	{
+		read_at(m_where, buf, n);
+		m_where += n;
+	}
+
+	void seek(int64_t offset, int whence) override
+	{
+		m_where = seek_address(offset, whence, 0, m_where, length());
+	}
+
+	uint64_t tell() const override { return m_where; }
+
+	uint64_t length() const override { return m_length - m_offset; }
+
+	void refresh() override
+	{
+		std::shared_ptr<IOStream> io;
+		{
+			std::lock_guard<std::mutex> lock{ open_files().mutex };
+			io = m_io;
+		}
+
+		// A closed file is not opened just to update its length.
+		if (io) {
+			io->refresh();
+			m_length = io->length() + m_offset;
+		} else {
+			stat_path();
+		}
+	}
+
+	rawz_stream_stats stats() const noexcept override
+	{
+		std::lock_guard<std::mutex> lock{ open_files().mutex };
+		rawz_stream_stats stats = m_closed_stats;
+
+		if (m_io)
+			add_stats(stats, m_io->stats());
+		return stats;
+	}
+
+	void advise(uint64_t offset, uint64_t n, Advice advice) noexcept override
+	{
+		std::shared_ptr<IOStream> io;
+		{
+			std::lock_guard<std::mutex> lock{ open_files().mutex };
+			io = m_io;
+		}
+
+		// Advice is not worth opening a file for.
+		if (io)
+			io->advise(offset, n, advice);
+	}
+
+	bool is_hole(uint64_t offset, uint64_t n) noexcept override
+	{
+		try {
+			return acquire()->is_hole(offset, n);
+		} catch (...) {
+			return false;
+		}
+	}
+
+	void release() noexcept override
+	{
+		OpenFiles &files = open_files();
+		std::shared_ptr<IOStream> io;
+		std::lock_guard<std::mutex> lock{ files.mutex };
+
+		if (m_io) {
+			files.lru.erase(m_lru_pos);
+			add_stats(m_closed_stats, m_io->stats());
+			io = std::move(m_io);
+		}
+	}
+
+	bool file_id(uint64_t &device, uint64_t &inode) const noexcept override
+	{
+		device = m_device;
+		inode = m_inode;
+		return m_has_id;
+	}
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		acquire()->read_batch(req, count);
+	}
+};
+
+} // namespace
+
+
+std::unique_ptr<IOStream> create_lazy_stream(const char *path, uint64_t offset, const rawz_io_options &options)
+{
+	return std::make_unique<LazyIOStream>(path, offset, options);
+}
+
+void set_max_open_files(size_t count)
+{
+	OpenFiles &files = open_files();
+	std::lock_guard<std::mutex> lock{ files.mutex };
+	files.max_open = count ? count : default_max_open_files;
+}
+
+} // namespace rawz
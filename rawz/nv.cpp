@@ -5,6 +5,7 @@
 #include "checked_int.h"
 #include "common.h"
 #include "io.h"
+#include "staging.h"
 #include "stream.h"
 
 namespace p2p = p2p_rawz;
@@ -18,11 +19,13 @@ typedef decltype(&p2p::packed_to_planar<p2p::packed_nv12>::unpack) deinterleave_
 
 class NVVideoStream : public VideoStream {
 	std::unique_ptr<IOStream> m_io;
+	PacketLayout m_layout;
 	rawz_format m_format;
 	deinterleave_func m_deinterleave;
+	size_t m_luma_plane_size;
 	size_t m_chroma_row_size;
 	uint64_t m_packet_size;
-	int64_t m_frameno;
+	StagingPool m_staging;
 
 	void init_deinterleave()
 	{
@@ -36,8 +39,6 @@ class NVVideoStream : public VideoStream {
 		default:
 			throw std::runtime_error{ "unsupported bit depth" };
 		}
-
-		m_chroma_row_size = static_cast<size_t>(m_format.width >> m_format.subsample_w) * m_format.bytes_per_sample;
 	}
 
 	void calculate_packet_size()
@@ -55,46 +56,45 @@ class NVVideoStream : public VideoStream {
 		chroma_row_size = ceil_aligned(chroma_row_size, m_format.alignment);
 
 		checked_size_t sz = luma_row_size * luma_height + chroma_row_size * chroma_height;
-		m_packet_size = sz.get();
+		m_luma_plane_size = (luma_row_size * luma_height).get();
+		m_chroma_row_size = chroma_row_size.get();
+		m_packet_size = m_layout.packet_size(sz.get());
 	}
 
-	void blit_nv_plane(void *u, void *v, ptrdiff_t stride_u, ptrdiff_t stride_v)
+	// The scratch row receives the samples of a plane that was not requested.
+	void deinterleave_plane(const uint8_t *src, void *u, void *v, ptrdiff_t stride_u, ptrdiff_t stride_v, uint8_t *tmp)
 	{
 		unsigned width = subsampled_dim(m_format.width, m_format.subsample_w);
 		unsigned height = subsampled_dim(m_format.height, m_format.subsample_h);
 
-		std::vector<uint8_t> buffer(m_chroma_row_size);
-		std::vector<uint8_t> tmp;
-
 		if (!u) {
-			tmp.resize(m_chroma_row_size / 2);
-			u = tmp.data();
+			u = tmp;
 			stride_u = 0;
 		}
 		if (!v) {
-			tmp.resize(m_chroma_row_size / 2);
-			v = tmp.data();
+			v = tmp;
 			stride_v = 0;
 		}
 
 		void *plane_ptrs[4] = { nullptr, u, v, nullptr };
 
 		for (unsigned i = 0; i < height; ++i) {
-			m_io->read(buffer.data(), buffer.size());
-			m_deinterleave(buffer.data(), plane_ptrs, 0, width << 1); // Convert back to luma width of hypothetical 4:2:2 plane.
+			m_deinterleave(src, plane_ptrs, 0, width << 1); // Convert back to luma width of hypothetical 4:2:2 plane.
 
+			src += m_chroma_row_size;
 			plane_ptrs[1] = advance_ptr(plane_ptrs[1], stride_u);
 			plane_ptrs[2] = advance_ptr(plane_ptrs[2], stride_v);
 		}
 	}
 public:
-	NVVideoStream(std::unique_ptr<IOStream> io, const rawz_format &format) :
+	NVVideoStream(std::unique_ptr<IOStream> io, const rawz_format &format, const PacketLayout &layout) :
 		m_io{ std::move(io) },
+		m_layout(layout),
 		m_format(format),
 		m_deinterleave{},
+		m_luma_plane_size{},
 		m_chroma_row_size{},
-		m_packet_size{},
-		m_frameno{ -1 }
+		m_packet_size{}
 	{
 		if (!is_valid_format(format))
 			throw std::runtime_error{ "invalid format" };
@@ -103,27 +103,46 @@ public:
 		calculate_packet_size();
 	}
 
-	int64_t framecount() const noexcept
-	{
-		return m_io->seekable() ? m_io->length() / m_packet_size : 0;
-	}
+	int64_t framecount() const noexcept { return m_layout.framecount(*m_io, m_packet_size); }
 
 	rawz_metadata metadata() const noexcept { return default_metadata(); }
 
-	void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4]) try
+	rawz_stream_stats stats() const noexcept { return m_io->stats(); }
+
+	uint64_t packet_offset(int64_t n) const { return m_layout.packet_offset(n, m_packet_size); }
+
+	uint64_t packet_size() const noexcept { return m_packet_size; }
+
+	void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4], rawz_frame_info *info)
 	{
-		seek_to_frame(m_io.get(), m_frameno, n, m_packet_size);
+		uint64_t offset = packet_offset(n);
+		unsigned chroma_height = subsampled_dim(m_format.height, m_format.subsample_h);
+		bool chroma = planes[1] || planes[2];
+		std::vector<unsigned char> header(m_layout.header_size());
+
+		// The packet header is read together with the planes.
+		std::vector<IORequest> req;
+		m_layout.header_request(req, offset, header.data());
+		offset += m_layout.prefix();
 
 		if (planes[0])
-			blit_plane(m_io.get(), m_format.width, m_format.height, m_format.bytes_per_sample, m_format.alignment, planes[0], stride[0]);
-		else
-			skip_plane(m_io.get(), m_format.width, m_format.height, m_format.bytes_per_sample, m_format.alignment);
-
-		blit_nv_plane(planes[1], planes[2], stride[1], stride[2]);
-		++m_frameno;
-	} catch (...) {
-		m_frameno = -1;
-		throw;
+			plane_requests(req, offset, m_format.width, m_format.height, m_format.bytes_per_sample, m_format.alignment, planes[0], stride[0]);
+
+		if (!chroma) {
+			m_io->read_batch(req.data(), req.size());
+			m_layout.decode_header(header.data(), info);
+			return;
+		}
+
+		// The chroma plane is read in one request and deinterleaved afterwards, followed by a scratch row.
+		size_t chroma_size = ceil_aligned(m_chroma_row_size * chroma_height, StagingPool::log2_alignment);
+		StagingBuffer staging = m_staging.acquire(chroma_size + m_chroma_row_size / 2);
+
+		req.push_back({ offset + m_luma_plane_size, staging.data(), m_chroma_row_size * chroma_height });
+		m_io->read_batch(req.data(), req.size());
+
+		m_layout.decode_header(header.data(), info);
+		deinterleave_plane(staging.data(), planes[1], planes[2], stride[1], stride[2], staging.data() + chroma_size);
 	}
 
 	const rawz_format &format() const { return m_format; }
@@ -132,9 +151,9 @@ public:
 } // namespace
 
 
-std::unique_ptr<VideoStream> create_nv_stream(std::unique_ptr<IOStream> io, rawz_format *format)
+std::unique_ptr<VideoStream> create_nv_stream(std::unique_ptr<IOStream> io, rawz_format *format, const PacketLayout &layout)
 {
-	std::unique_ptr<NVVideoStream> stream = std::make_unique<NVVideoStream>(std::move(io), *format);
+	std::unique_ptr<NVVideoStream> stream = std::make_unique<NVVideoStream>(std::move(io), *format, layout);
 	*format = stream->format();
 	return std::move(stream);
 }
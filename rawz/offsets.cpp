@@ -0,0 +1,140 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "io.h"
+#include "stream.h"
+
+namespace rawz {
+
+namespace {
+
+uint64_t decode_le64(const unsigned char *ptr)
+{
+	uint64_t value = 0;
+	for (unsigned i = 8; i > 0; --i) {
+		value = (value << 8) | ptr[i - 1];
+	}
+	return value;
+}
+
+bool has_text_extension(const std::string &path)
+{
+	return path.size() >= 4 && (path.compare(path.size() - 4, 4, ".txt") == 0 || path.compare(path.size() - 4, 4, ".TXT") == 0);
+}
+
+std::vector<unsigned char> read_file(IOStream &io)
+{
+	uint64_t length = io.length();
+	if (length > SIZE_MAX)
+		throw std::runtime_error{ "offset table too large" };
+
+	std::vector<unsigned char> buf(static_cast<size_t>(length));
+	if (!buf.empty())
+		io.read_at(0, buf.data(), buf.size());
+	return buf;
+}
+
+// One decimal or hexadecimal (0x) offset per line. Blank lines and lines starting with # are ignored.
+std::vector<uint64_t> parse_text(const std::vector<unsigned char> &text)
+{
+	std::vector<uint64_t> offsets;
+	std::string line;
+	size_t line_number = 0;
+
+	for (size_t pos = 0; pos < text.size();) {
+		size_t end = pos;
+		while (end < text.size() && text[end] != '\n')
+			++end;
+
+		line.assign(text.begin() + pos, text.begin() + end);
+		pos = end + 1;
+		++line_number;
+
+		size_t first = line.find_first_not_of(" \t\r");
+		if (first == std::string::npos || line[first] == '#')
+			continue;
+
+		const char *str = line.c_str() + first;
+		bool hex = str[0] == '0' && (str[1] == 'x' || str[1] == 'X');
+		char *str_end = nullptr;
+
+		errno = 0;
+		unsigned long long value = std::strtoull(str, &str_end, hex ? 16 : 10);
+
+		if (str_end == str || *str == '-' || errno || std::strspn(str_end, " \t\r") != std::strlen(str_end))
+			throw std::runtime_error{ "invalid offset table entry on line " + std::to_string(line_number) };
+
+		offsets.push_back(value);
+	}
+
+	return offsets;
+}
+
+} // namespace
+
+
+OffsetTable::OffsetTable(std::vector<uint64_t> offsets) :
+	m_offsets(std::move(offsets)),
+	m_data{},
+	m_size{ static_cast<int64_t>(m_offsets.size()) }
+{}
+
+OffsetTable::OffsetTable(std::unique_ptr<IOStream> file) :
+	m_data{},
+	m_size{}
+{
+	if (file->length() % 8)
+		throw std::runtime_error{ "offset table size not a multiple of 8" };
+
+	// Tables of memory-mapped files are used in place.
+	if (file->data()) {
+		m_file = std::move(file);
+		m_data = static_cast<const unsigned char *>(m_file->data());
+		m_size = static_cast<int64_t>(m_file->length() / 8);
+		return;
+	}
+
+	std::vector<unsigned char> buf = read_file(*file);
+	m_offsets.resize(buf.size() / 8);
+
+	for (size_t i = 0; i < m_offsets.size(); ++i) {
+		m_offsets[i] = decode_le64(buf.data() + i * 8);
+	}
+	m_size = static_cast<int64_t>(m_offsets.size());
+}
+
+OffsetTable::~OffsetTable() = default;
+
+uint64_t OffsetTable::offset(int64_t n) const
+{
+	if (n < 0 || n >= m_size)
+		throw IOStream::eof{};
+	return m_data ? decode_le64(m_data + static_cast<size_t>(n) * 8) : m_offsets[static_cast<size_t>(n)];
+}
+
+
+std::shared_ptr<const OffsetTable> create_offset_table(const uint64_t *offsets, size_t count)
+{
+	return std::make_shared<OffsetTable>(std::vector<uint64_t>(offsets, offsets + count));
+}
+
+std::shared_ptr<const OffsetTable> load_offset_table(const char *path)
+{
+	rawz_io_options options;
+	rawz_io_options_default(&options);
+
+	if (has_text_extension(path)) {
+		std::unique_ptr<IOStream> io = create_stdio_stream(path, true, 0, options);
+		return std::make_shared<OffsetTable>(parse_text(read_file(*io)));
+	}
+
+	options.mode = RAWZ_IO_MMAP;
+	return std::make_shared<OffsetTable>(create_mmap_stream(path, true, 0, options));
+}
+
+} // namespace rawz
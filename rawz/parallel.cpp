@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "io.h"
+
+namespace rawz {
+
+namespace {
+
+constexpr size_t default_range_size = 4UL << 20;
+constexpr size_t min_range_size = 64UL << 10;
+
+
+// Splits batches larger than one range into bands of at most range_size bytes, which are read concurrently.
+// The calling thread reads bands as well, so threads - 1 workers are created.
+class ParallelIOStream : public IOStream {
+	struct Job {
+		const IORequest *req;
+		const size_t *bounds; // Band i consists of req[bounds[i]] to req[bounds[i + 1]].
+		size_t count;
+		size_t next;
+		size_t pending;
+		std::exception_ptr error;
+	};
+
+	std::unique_ptr<IOStream> m_io;
+	size_t m_range_size;
+
+	std::mutex m_mutex;
+	std::condition_variable m_work_cv;
+	std::condition_variable m_done_cv;
+	std::deque<Job *> m_queue;
+	bool m_quit;
+	std::vector<std::thread> m_threads;
+
+	// Takes the next band of a job. The job leaves the queue with its last band.
+	size_t take_band(Job *job)
+	{
+		size_t band = job->next++;
+		if (job->next == job->count)
+			m_queue.erase(std::find(m_queue.begin(), m_queue.end(), job));
+		return band;
+	}
+
+	void run_band(std::unique_lock<std::mutex> &lock, Job *job, size_t band)
+	{
+		std::exception_ptr error;
+
+		lock.unlock();
+		try {
+			m_io->read_batch(job->req + job->bounds[band], job->bounds[band + 1] - job->bounds[band]);
+		} catch (...) {
+			error = std::current_exception();
+		}
+		lock.lock();
+
+		if (error && !job->error)
+			job->error = error;
+		if (!--job->pending)
+			m_done_cv.notify_all();
+	}
+
+	void worker()
+	{
+		std::unique_lock<std::mutex> lock{ m_mutex };
+
+		while (true) {
+			m_work_cv.wait(lock, [&]() { return m_quit || !m_queue.empty(); });
+			if (m_quit)
+				break;
+
+			Job *job = m_queue.front();
+			run_band(lock, job, take_band(job));
+		}
+	}
+public:
+	ParallelIOStream(std::unique_ptr<IOStream> io, size_t range_size, unsigned threads) :
+		m_io{ std::move(io) },
+		m_range_size{ std::max(range_size ? range_size : default_range_size, min_range_size) },
+		m_quit{}
+	{
+		for (unsigned i = 1; i < threads; ++i) {
+			m_threads.emplace_back(&ParallelIOStream::worker, this);
+		}
+	}
+
+	ParallelIOStream(const ParallelIOStream &) = delete;
+
+	~ParallelIOStream()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			m_quit = true;
+		}
+		m_work_cv.notify_all();
+
+		for (std::thread &thread : m_threads) {
+			thread.join();
+		}
+	}
+
+	ParallelIOStream &operator=(const ParallelIOStream &) = delete;
+
+	bool seekable() const override { return m_io->seekable(); }
+
+	void read(void *buf, size_t n) override { m_io->read(buf, n); }
+
+	void seek(int64_t offset, int whence) override { m_io->seek(offset, whence); }
+
+	uint64_t tell() const override { return m_io->tell(); }
+
+	uint64_t length() const override { return m_io->length(); }
+
+	void skip(size_t n) override { m_io->skip(n); }
+
+	void refresh() override { m_io->refresh(); }
+
+	const void *data() const noexcept override { return m_io->data(); }
+
+	rawz_stream_stats stats() const noexcept override { return m_io->stats(); }
+
+	void advise(uint64_t offset, uint64_t n, Advice advice) noexcept override { m_io->advise(offset, n, advice); }
+
+	bool is_hole(uint64_t offset, uint64_t n) noexcept override { return m_io->is_hole(offset, n); }
+
+	void release() noexcept override { m_io->release(); }
+
+	bool file_id(uint64_t &device, uint64_t &inode) const noexcept override { return m_io->file_id(device, inode); }
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		uint64_t total = 0;
+		for (size_t i = 0; i < count; ++i) {
+			total += req[i].n;
+		}
+
+		if (total <= m_range_size) {
+			m_io->read_batch(req, count);
+			return;
+		}
+
+		// Large requests, e.g. whole planes, are cut into ranges. Small ones, e.g. padded rows, are grouped into bands.
+		std::vector<IORequest> split;
+		std::vector<size_t> bounds{ 0 };
+		size_t band_bytes = 0;
+
+		for (size_t i = 0; i < count; ++i) {
+			if (req[i].n > UINT64_MAX - req[i].offset)
+				throw eof{};
+
+			uint64_t offset = req[i].offset;
+			unsigned char *buf = static_cast<unsigned char *>(req[i].buf);
+			size_t n = req[i].n;
+
+			while (n) {
+				size_t chunk = std::min(n, m_range_size - band_bytes);
+
+				split.push_back({ offset, buf, chunk });
+				band_bytes += chunk;
+				offset += chunk;
+				buf += chunk;
+				n -= chunk;
+
+				if (band_bytes == m_range_size) {
+					bounds.push_back(split.size());
+					band_bytes = 0;
+				}
+			}
+		}
+		if (band_bytes)
+			bounds.push_back(split.size());
+
+		Job job{ split.data(), bounds.data(), bounds.size() - 1, 0, bounds.size() - 1, nullptr };
+		std::unique_lock<std::mutex> lock{ m_mutex };
+
+		m_queue.push_back(&job);
+		m_work_cv.notify_all();
+
+		while (job.next < job.count) {
+			run_band(lock, &job, take_band(&job));
+		}
+
+		m_done_cv.wait(lock, [&]() { return !job.pending; });
+		if (job.error)
+			std::rethrow_exception(job.error);
+	}
+};
+
+} // namespace
+
+
+std::unique_ptr<IOStream> create_parallel_stream(std::unique_ptr<IOStream> io, size_t range_size, unsigned threads)
+{
+	// Pipes are read in order.
+	if (threads < 2 || !io->seekable())
+		return io;
+
+	return std::make_unique<ParallelIOStream>(std::move(io), range_size, threads);
+}
+
+} // namespace rawz
@@ -1,4 +1,5 @@
 #include <stdexcept>
+#include <vector>
 #include "io.h"
 #include "stream.h"
 
@@ -8,46 +9,70 @@ namespace {
 
 class PlanarVideoStream : public VideoStream {
 	std::unique_ptr<IOStream> m_io;
+	PacketLayout m_layout;
 	rawz_format m_format;
 	uint64_t m_packet_size;
-	int64_t m_frameno;
 public:
-	PlanarVideoStream(std::unique_ptr<IOStream> io, const rawz_format &format) :
+	PlanarVideoStream(std::unique_ptr<IOStream> io, const rawz_format &format, const PacketLayout &layout) :
 		m_io{ std::move(io) },
+		m_layout(layout),
 		m_format(format),
-		m_packet_size{},
-		m_frameno{ -1 }
+		m_packet_size{}
 	{
 		if (!is_valid_format(format))
 			throw std::runtime_error{ "invalid format" };
 
-		m_packet_size = planar_frame_size(m_format);
+		m_packet_size = m_layout.packet_size(planar_frame_size(m_format));
 	}
 
-	int64_t framecount() const noexcept
-	{
-		return m_io->seekable() ? m_io->length() / m_packet_size : 0;
-	}
+	int64_t framecount() const noexcept { return m_layout.framecount(*m_io, m_packet_size); }
 
 	rawz_metadata metadata() const noexcept { return default_metadata(); }
 
-	void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4]) try
+	rawz_stream_stats stats() const noexcept { return m_io->stats(); }
+
+	uint64_t packet_offset(int64_t n) const { return m_layout.packet_offset(n, m_packet_size); }
+
+	uint64_t packet_size() const noexcept { return m_packet_size; }
+
+	void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4], rawz_frame_info *info)
+	{
+		uint64_t offset = packet_offset(n);
+		std::vector<unsigned char> header(m_layout.header_size());
+
+		// The packet header is read together with the planes.
+		std::vector<IORequest> req;
+		m_layout.header_request(req, offset, header.data());
+		planar_frame_requests(req, offset + m_layout.prefix(), m_format, planes, stride);
+		m_io->read_batch(req.data(), req.size());
+
+		m_layout.decode_header(header.data(), info);
+	}
+
+	bool map(int64_t n, const void *planes[4], ptrdiff_t stride[4])
 	{
-		seek_to_frame(m_io.get(), m_frameno, n, m_packet_size);
-		blit_planar_frame(m_io.get(), m_format, planes, stride);
-		++m_frameno;
-	} catch (...) {
-		m_frameno = -1;
-		throw;
+		const unsigned char *data = static_cast<const unsigned char *>(m_io->data());
+		if (!data)
+			return false;
+		if (n < 0 || n >= framecount())
+			throw IOStream::eof{};
+
+		// Offset tables may point past the end of the file.
+		uint64_t offset = packet_offset(n);
+		if (offset > m_io->length() || m_packet_size > m_io->length() - offset)
+			throw IOStream::eof{};
+
+		map_planar_frame(data + offset + m_layout.prefix(), m_format, planes, stride);
+		return true;
 	}
 };
 
 } // namespace
 
 
-std::unique_ptr<VideoStream> create_planar_stream(std::unique_ptr<IOStream> io, const rawz_format *format)
+std::unique_ptr<VideoStream> create_planar_stream(std::unique_ptr<IOStream> io, const rawz_format *format, const PacketLayout &layout)
 {
-	return std::make_unique<PlanarVideoStream>(std::move(io), *format);
+	return std::make_unique<PlanarVideoStream>(std::move(io), *format, layout);
 }
 
 } // namespace rawz
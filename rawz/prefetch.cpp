@@ -0,0 +1,397 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "io.h"
+#include "stream.h"
+
+namespace rawz {
+
+namespace {
+
+// Prefetches are read in chunks, so that a cancelled prefetch stops early.
+constexpr size_t chunk_size = 1UL << 20;
+
+
+// Serves positional reads from a ring of raw packets filled on a background thread. The frames read ahead continue the
+// progression of recent requests, i.e. forward, reverse or every Nth frame.
+class PrefetchIOStream : public IOStream {
+	struct Slot {
+		std::vector<uint8_t> data;
+		int64_t frame = -1;
+		uint64_t offset = 0;
+		bool ready = false;
+		bool pending = false;
+		unsigned readers = 0;
+
+		bool contains(uint64_t pos, size_t n) const
+		{
+			return frame >= 0 && pos >= offset && pos - offset <= data.size() && n <= data.size() - (pos - offset);
+		}
+	};
+
+	std::unique_ptr<IOStream> m_io;
+	const VideoStream *m_stream;
+	std::vector<Slot> m_slots;
+	int64_t m_depth;
+	int64_t m_head;
+	int64_t m_stride;
+	int64_t m_last;
+	int64_t m_last_delta;
+	int64_t m_failed;
+	std::atomic<uint64_t> m_generation;
+	bool m_quit;
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_work_cv;
+	std::condition_variable m_ready_cv;
+
+	bool is_buffered(int64_t frame) const
+	{
+		return std::any_of(m_slots.begin(), m_slots.end(), [=](const Slot &slot) { return slot.frame == frame; });
+	}
+
+	// Returns whether frame lies on the progression, and its number of steps after the head.
+	bool step_of(int64_t frame, int64_t &step) const
+	{
+		if (m_head < 0 || frame < 0 || (frame - m_head) % m_stride)
+			return false;
+
+		step = (frame - m_head) / m_stride;
+		return true;
+	}
+
+	bool in_window(int64_t frame) const
+	{
+		int64_t step;
+		return step_of(frame, step) && step >= 0 && step <= m_depth;
+	}
+
+	// Returns the next frame to prefetch, or -1.
+	int64_t next_frame() const
+	{
+		if (m_head < 0)
+			return -1;
+
+		int64_t framecount = m_stream->framecount();
+
+		int64_t frame = m_head;
+
+		for (int64_t k = 1; k <= m_depth; ++k) {
+			if (m_stride > 0 ? frame >= framecount - m_stride : frame < -m_stride)
+				break;
+
+			frame += m_stride;
+			if (frame != m_failed && !is_buffered(frame))
+				return frame;
+		}
+		return -1;
+	}
+
+	void cancel()
+	{
+		++m_generation;
+		m_head = -1;
+		m_failed = -1;
+
+		for (Slot &slot : m_slots) {
+			if (slot.ready && !slot.readers) {
+				slot.frame = -1;
+				slot.ready = false;
+			}
+		}
+	}
+
+	Slot *free_slot()
+	{
+		for (Slot &slot : m_slots) {
+			if (!slot.pending && !slot.readers && !in_window(slot.frame))
+				return &slot;
+		}
+		return nullptr;
+	}
+
+	void worker()
+	{
+		std::unique_lock<std::mutex> lock{ m_mutex };
+
+		while (true) {
+			int64_t frame = -1;
+			Slot *slot = nullptr;
+
+			m_work_cv.wait(lock, [&]()
+			{
+				if (m_quit)
+					return true;
+				return (frame = next_frame()) >= 0 && (slot = free_slot());
+			});
+			if (m_quit)
+				break;
+
+			uint64_t generation = m_generation;
+			bool ok = false;
+
+			try {
+				slot->frame = frame;
+				slot->offset = m_stream->packet_offset(frame);
+				slot->data.resize(m_stream->packet_size());
+				slot->ready = false;
+				slot->pending = true;
+				lock.unlock();
+
+				// Holes of sparse files read as zeros.
+				if (m_io->is_hole(slot->offset, slot->data.size())) {
+					std::fill(slot->data.begin(), slot->data.end(), 0);
+				} else {
+					for (size_t pos = 0; pos < slot->data.size() && m_generation == generation; pos += chunk_size) {
+						size_t n = std::min(chunk_size, slot->data.size() - pos);
+						m_io->read_at(slot->offset + pos, slot->data.data() + pos, n);
+					}
+				}
+				ok = m_generation == generation;
+			} catch (...) {
+				// Errors are reported by the foreground read instead.
+				if (!lock)
+					lock.lock();
+				if (m_generation == generation)
+					m_failed = frame;
+			}
+
+			if (!lock)
+				lock.lock();
+
+			slot->pending = false;
+			slot->ready = ok;
+			if (!ok)
+				slot->frame = -1;
+			m_ready_cv.notify_all();
+		}
+	}
+public:
+	explicit PrefetchIOStream(std::unique_ptr<IOStream> io) :
+		m_io{ std::move(io) },
+		m_stream{},
+		m_depth{},
+		m_head{ -1 },
+		m_stride{ 1 },
+		m_last{ -1 },
+		m_last_delta{},
+		m_failed{ -1 },
+		m_generation{},
+		m_quit{}
+	{}
+
+	PrefetchIOStream(const PrefetchIOStream &) = delete;
+
+	~PrefetchIOStream() { stop(); }
+
+	PrefetchIOStream &operator=(const PrefetchIOStream &) = delete;
+
+	void start(const VideoStream *stream, unsigned depth, size_t max_bytes)
+	{
+		uint64_t packet_size = stream->packet_size();
+
+		// One slot holds the frame being read, the rest hold the frames after it.
+		if (max_bytes)
+			depth = static_cast<unsigned>(std::min(static_cast<uint64_t>(depth), max_bytes / packet_size - std::min(max_bytes / packet_size, UINT64_C(1))));
+		if (!depth || !m_io->seekable())
+			return;
+
+		m_stream = stream;
+		m_depth = depth;
+		m_slots.resize(depth + 1);
+
+		for (Slot &slot : m_slots) {
+			slot.data.reserve(packet_size);
+		}
+
+		m_thread = std::thread{ &PrefetchIOStream::worker, this };
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			m_quit = true;
+		}
+		m_work_cv.notify_all();
+
+		if (m_thread.joinable())
+			m_thread.join();
+	}
+
+	// Records an access to frame n. A step of one frame, or the same step twice in a row, starts a new progression.
+	// Other accesses off the current progression cancel outstanding prefetches.
+	void access(int64_t n)
+	{
+		// Frames out of range fail to read and do not affect prefetching.
+		if (!m_thread.joinable() || n < 0 || n >= m_stream->framecount())
+			return;
+
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		int64_t delta = n - m_last;
+		int64_t step;
+
+		if (!delta)
+			return;
+
+		bool repeated = delta == m_last_delta;
+		m_last = n;
+		m_last_delta = delta;
+
+		// Concurrent requests may arrive slightly out of order, so recent frames behind the head are tolerated. A step
+		// that repeats within the window, e.g. every other frame, replaces the progression.
+		if (step_of(n, step) && step >= -m_depth && step <= m_depth && (!repeated || delta == m_stride)) {
+			if (step > 0)
+				m_head = n;
+			m_work_cv.notify_one();
+			return;
+		}
+
+		cancel();
+
+		if (delta == 1 || repeated) {
+			m_head = n;
+			m_stride = delta;
+			m_work_cv.notify_one();
+		}
+	}
+
+	bool seekable() const override { return m_io->seekable(); }
+
+	void read(void *buf, size_t n) override { m_io->read(buf, n); }
+
+	void seek(int64_t offset, int whence) override { m_io->seek(offset, whence); }
+
+	uint64_t tell() const override { return m_io->tell(); }
+
+	uint64_t length() const override { return m_io->length(); }
+
+	void skip(size_t n) override { m_io->skip(n); }
+
+	const void *data() const noexcept override { return m_io->data(); }
+
+	rawz_stream_stats stats() const noexcept override { return m_io->stats(); }
+
+	void advise(uint64_t offset, uint64_t n, Advice advice) noexcept override { m_io->advise(offset, n, advice); }
+
+	bool is_hole(uint64_t offset, uint64_t n) noexcept override { return m_io->is_hole(offset, n); }
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		if (!m_thread.joinable()) {
+			m_io->read_batch(req, count);
+			return;
+		}
+
+		std::vector<Slot *> hits(count);
+		std::vector<IORequest> misses;
+
+		{
+			std::unique_lock<std::mutex> lock{ m_mutex };
+
+			// Wait for a prefetch of the same data to complete instead of reading it again.
+			auto find_slot = [&](const IORequest &r) -> Slot *
+			{
+				for (Slot &slot : m_slots) {
+					if ((slot.ready || slot.pending) && slot.contains(r.offset, r.n))
+						return &slot;
+				}
+				return nullptr;
+			};
+
+			for (size_t i = 0; i < count; ++i) {
+				Slot *slot;
+
+				m_ready_cv.wait(lock, [&]() { return !(slot = find_slot(req[i])) || slot->ready; });
+				hits[i] = slot;
+
+				if (slot)
+					++slot->readers;
+				else
+					misses.push_back(req[i]);
+			}
+		}
+
+		for (size_t i = 0; i < count; ++i) {
+			if (hits[i])
+				std::memcpy(req[i].buf, hits[i]->data.data() + (req[i].offset - hits[i]->offset), req[i].n);
+		}
+
+		auto release = [&]()
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			for (Slot *slot : hits) {
+				if (slot)
+					--slot->readers;
+			}
+			m_work_cv.notify_one();
+		};
+
+		try {
+			m_io->read_batch(misses.data(), misses.size());
+		} catch (...) {
+			release();
+			throw;
+		}
+		release();
+	}
+};
+
+
+class PrefetchVideoStream : public VideoStream {
+	std::unique_ptr<VideoStream> m_stream;
+	PrefetchIOStream *m_io;
+public:
+	PrefetchVideoStream(std::unique_ptr<VideoStream> stream, PrefetchIOStream *io) :
+		m_stream{ std::move(stream) },
+		m_io{ io }
+	{}
+
+	// The prefetch thread must exit before the stream it queries is destroyed.
+	~PrefetchVideoStream() { m_io->stop(); }
+
+	int64_t framecount() const noexcept override { return m_stream->framecount(); }
+
+	rawz_metadata metadata() const noexcept override { return m_stream->metadata(); }
+
+	rawz_stream_stats stats() const noexcept override { return m_stream->stats(); }
+
+	uint64_t packet_offset(int64_t n) const override { return m_stream->packet_offset(n); }
+
+	uint64_t packet_size() const noexcept override { return m_stream->packet_size(); }
+
+	void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4], rawz_frame_info *info) override
+	{
+		m_io->access(n);
+		m_stream->read(n, planes, stride, info);
+	}
+
+	bool map(int64_t n, const void *planes[4], ptrdiff_t stride[4]) override
+	{
+		return m_stream->map(n, planes, stride);
+	}
+};
+
+} // namespace
+
+
+std::unique_ptr<VideoStream> create_prefetch_stream(std::unique_ptr<IOStream> io, rawz_format *format, const PacketLayout &layout,
+                                                   unsigned depth, size_t max_bytes)
+{
+	std::unique_ptr<PrefetchIOStream> prefetch_io = std::make_unique<PrefetchIOStream>(std::move(io));
+	PrefetchIOStream *prefetch_io_ptr = prefetch_io.get();
+
+	std::unique_ptr<VideoStream> stream = create_video_stream(std::move(prefetch_io), format, layout);
+	prefetch_io_ptr->start(stream.get(), depth, max_bytes);
+
+	return std::make_unique<PrefetchVideoStream>(std::move(stream), prefetch_io_ptr);
+}
+
+} // namespace rawz
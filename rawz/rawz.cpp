@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstring>
 #include <stdexcept>
 #include <string>
 #include "io.h"
@@ -28,6 +30,39 @@ void record_exception() noexcept
 	}
 }
 
+rawz_io_options get_io_options(const rawz_io_options *options)
+{
+	rawz_io_options opts;
+	rawz_io_options_default(&opts);
+
+	// Callers built against an older header pass a smaller struct.
+	if (options) {
+		if (options->size < sizeof(options->size))
+			throw std::invalid_argument{ "rawz_io_options not initialized" };
+
+		std::memcpy(&opts, options, std::min(options->size, sizeof(opts)));
+		opts.size = sizeof(opts);
+	}
+
+	return opts;
+}
+
+rawz_stream_options get_stream_options(const rawz_stream_options *options)
+{
+	rawz_stream_options opts;
+	rawz_stream_options_default(&opts);
+
+	if (options) {
+		if (options->size < sizeof(options->size))
+			throw std::invalid_argument{ "rawz_stream_options not initialized" };
+
+		std::memcpy(&opts, options, std::min(options->size, sizeof(opts)));
+		opts.size = sizeof(opts);
+	}
+
+	return opts;
+}
+
 } // namespace
 
 
@@ -41,17 +76,35 @@ void rawz_clear_last_error()
 	g_last_error.clear();
 }
 
-rawz_io_stream *rawz_io_open_file(const char *path, int seekable, uint64_t offset) try
+rawz_io_stream *rawz_io_open_file(const char *path, int seekable, uint64_t offset)
 {
-	return rawz::create_stdio_stream(path, !!seekable, offset).release();
+	return rawz_io_open_file2(path, seekable, offset, nullptr);
+}
+
+rawz_io_stream *rawz_io_open_fd(int fd, int seekable, uint64_t offset)
+{
+	return rawz_io_open_fd2(fd, seekable, offset, nullptr);
+}
+
+rawz_io_stream *rawz_io_open_file2(const char *path, int seekable, uint64_t offset, const rawz_io_options *options) try
+{
+	return rawz::create_file_stream(path, !!seekable, offset, get_io_options(options)).release();
 } catch (...) {
 	record_exception();
 	return nullptr;
 }
 
-rawz_io_stream *rawz_io_open_fd(int fd, int seekable, uint64_t offset) try
+rawz_io_stream *rawz_io_open_fd2(int fd, int seekable, uint64_t offset, const rawz_io_options *options) try
 {
-	return rawz::create_stdio_stream_fd(fd, !!seekable, offset).release();
+	return rawz::create_file_stream_fd(fd, !!seekable, offset, get_io_options(options)).release();
+} catch (...) {
+	record_exception();
+	return nullptr;
+}
+
+rawz_io_stream *rawz_io_open_segments(const char * const *paths, size_t count, uint64_t offset, const rawz_io_options *options) try
+{
+	return rawz::create_segmented_stream({ paths, paths + count }, offset, get_io_options(options)).release();
 } catch (...) {
 	record_exception();
 	return nullptr;
@@ -66,33 +119,122 @@ rawz_io_stream *rawz_io_wrap_user(rawz_io_user_read read, rawz_io_user_seek seek
 	return nullptr;
 }
 
+rawz_io_stream *rawz_io_wrap_user_batch(rawz_io_user_read_batch read_batch, rawz_io_user_close close, int64_t length, void *user) try
+{
+	return rawz::create_user_batch_stream(read_batch, close, length, user).release();
+} catch (...) {
+	record_exception();
+	return nullptr;
+}
+
+rawz_io_stream *rawz_io_throttle(rawz_io_stream *io, uint64_t bytes_per_sec, unsigned iops) try
+{
+	std::unique_ptr<rawz::IOStream> io_ptr{ static_cast<rawz::IOStream *>(io) };
+	return rawz::create_throttle_stream(std::move(io_ptr), bytes_per_sec, iops, false).release();
+} catch (...) {
+	record_exception();
+	return nullptr;
+}
+
+void rawz_set_process_io_limits(uint64_t bytes_per_sec, unsigned iops)
+{
+	rawz::set_process_limits(bytes_per_sec, iops);
+}
+
+void rawz_set_max_open_files(size_t count)
+{
+	rawz::set_max_open_files(count);
+}
+
+rawz_io_stream *rawz_io_open_shm(const char *name, const rawz_io_options *options) try
+{
+	return rawz::create_shm_stream(name, get_io_options(options).follow_timeout).release();
+} catch (...) {
+	record_exception();
+	return nullptr;
+}
+
+rawz_io_stream *rawz_io_open_shm_fd(int fd, const rawz_io_options *options) try
+{
+	return rawz::create_shm_stream_fd(fd, get_io_options(options).follow_timeout).release();
+} catch (...) {
+	record_exception();
+	return nullptr;
+}
+
 void rawz_io_stream_close(rawz_io_stream *ptr)
 {
 	delete static_cast<rawz::IOStream *>(ptr);
 }
 
-rawz_video_stream *rawz_video_stream_create(rawz_io_stream *io, rawz_format *format) try
+rawz_shm_producer *rawz_shm_producer_create(const char *name, uint64_t slot_size, unsigned slot_count) try
+{
+	return rawz::create_shm_producer(name, slot_size, slot_count).release();
+} catch (...) {
+	record_exception();
+	return nullptr;
+}
+
+rawz_shm_producer *rawz_shm_producer_create_fd(int fd, uint64_t slot_size, unsigned slot_count) try
+{
+	return rawz::create_shm_producer_fd(fd, slot_size, slot_count).release();
+} catch (...) {
+	record_exception();
+	return nullptr;
+}
+
+void *rawz_shm_producer_slot(rawz_shm_producer *ptr)
+{
+	return static_cast<rawz::ShmProducer *>(ptr)->slot();
+}
+
+void rawz_shm_producer_publish(rawz_shm_producer *ptr)
+{
+	static_cast<rawz::ShmProducer *>(ptr)->publish();
+}
+
+void rawz_shm_producer_free(rawz_shm_producer *ptr)
+{
+	delete static_cast<rawz::ShmProducer *>(ptr);
+}
+
+rawz_video_stream *rawz_video_stream_create(rawz_io_stream *io, rawz_format *format)
+{
+	return rawz_video_stream_create2(io, format, nullptr);
+}
+
+rawz_video_stream *rawz_video_stream_create2(rawz_io_stream *io, rawz_format *format, const rawz_stream_options *options) try
 {
 	std::unique_ptr<rawz::IOStream> io_ptr{ static_cast<rawz::IOStream *>(io) };
+	rawz::IOStream *io_raw = io_ptr.get();
+	rawz_stream_options opts = get_stream_options(options);
+	std::shared_ptr<const rawz::OffsetTable> table;
+	std::unique_ptr<rawz::VideoStream> stream;
 
-	switch (format->mode) {
-	case RAWZ_PLANAR:
-		return rawz::create_planar_stream(std::move(io_ptr), format).release();
-	case RAWZ_Y4M:
-		return rawz::create_y4m_stream(std::move(io_ptr), format).release();
-	case RAWZ_NV:
-		return rawz::create_nv_stream(std::move(io_ptr), format).release();
-	case RAWZ_ARGB:
-	case RAWZ_RGBA:
-	case RAWZ_RGB:
-	case RAWZ_RGB30:
-	case RAWZ_YUYV:
-	case RAWZ_UYVY:
-	case RAWZ_V210:
-		return rawz::create_interleaved_stream(std::move(io_ptr), format).release();
-	default:
-		throw std::runtime_error{ "unsupported packing mode" };
-	}
+	if (opts.frame_offsets_path)
+		table = rawz::load_offset_table(opts.frame_offsets_path);
+	else if (opts.frame_offsets_count)
+		table = rawz::create_offset_table(opts.frame_offsets, opts.frame_offsets_count);
+
+	rawz::PacketLayout layout{ std::move(table), opts.packet_prefix, opts.packet_suffix, opts.header_fields, opts.header_field_count };
+
+	if (opts.prefetch_depth)
+		stream = rawz::create_prefetch_stream(std::move(io_ptr), format, layout, opts.prefetch_depth, opts.prefetch_bytes);
+	else
+		stream = rawz::create_video_stream(std::move(io_ptr), format, layout);
+
+	if (opts.framecount > 0)
+		stream = rawz::create_fixed_length_stream(std::move(stream), opts.framecount);
+	if (opts.sparse)
+		stream = rawz::create_sparse_stream(std::move(stream), io_raw, *format);
+	if (opts.drop_behind || opts.willneed_depth)
+		stream = rawz::create_advised_stream(std::move(stream), io_raw, !!opts.drop_behind, opts.willneed_depth);
+	if (opts.cache_bytes)
+		stream = rawz::create_cached_stream(std::move(stream), *format, opts.cache_bytes);
+
+	// Lazily opened files are not needed until the first frame is read.
+	io_raw->release();
+	return stream.release();
 } catch (...) {
 	record_exception();
 	return nullptr;
@@ -108,9 +250,34 @@ void rawz_video_stream_metadata(const rawz_video_stream *ptr, rawz_metadata *met
 	*metadata = static_cast<const rawz::VideoStream *>(ptr)->metadata();
 }
 
-int rawz_video_stream_read(rawz_video_stream *ptr, int64_t n, void * const planes[4], const ptrdiff_t stride[4]) try
+void rawz_video_stream_stats(const rawz_video_stream *ptr, rawz_stream_stats *stats)
+{
+	*stats = static_cast<const rawz::VideoStream *>(ptr)->stats();
+}
+
+int rawz_video_stream_read(rawz_video_stream *ptr, int64_t n, void * const planes[4], const ptrdiff_t stride[4])
+{
+	rawz_frame_info info;
+	return rawz_video_stream_read_info(ptr, n, planes, stride, &info);
+}
+
+int rawz_video_stream_read_info(rawz_video_stream *ptr, int64_t n, void * const planes[4], const ptrdiff_t stride[4], rawz_frame_info *info) try
 {
-	static_cast<rawz::VideoStream *>(ptr)->read(n, planes, stride);
+	*info = rawz_frame_info{};
+	static_cast<rawz::VideoStream *>(ptr)->read(n, planes, stride, info);
+	return 0;
+} catch (const rawz::IOStream::eof &) {
+	record_exception();
+	return 1;
+} catch (...) {
+	record_exception();
+	return -1;
+}
+
+int rawz_video_stream_map(rawz_video_stream *ptr, int64_t n, const void *planes[4], ptrdiff_t stride[4]) try
+{
+	if (!static_cast<rawz::VideoStream *>(ptr)->map(n, planes, stride))
+		throw std::runtime_error{ "stream is not memory-mapped" };
 	return 0;
 } catch (const rawz::IOStream::eof &) {
 	record_exception();
@@ -129,3 +296,17 @@ void rawz_format_default(rawz_format *ptr)
 {
 	*ptr = rawz_format{};
 }
+
+void rawz_io_options_default(rawz_io_options *ptr)
+{
+	*ptr = rawz_io_options{};
+	ptr->size = sizeof(rawz_io_options);
+	ptr->mode = RAWZ_IO_STDIO;
+	ptr->advice = RAWZ_IO_ADVICE_NORMAL;
+}
+
+void rawz_stream_options_default(rawz_stream_options *ptr)
+{
+	*ptr = rawz_stream_options{};
+	ptr->size = sizeof(rawz_stream_options);
+}
@@ -52,7 +52,51 @@ void rawz_clear_last_error(void);
 
 typedef struct rawz_io_stream rawz_io_stream;
 
+typedef enum rawz_io_mode {
+	RAWZ_IO_STDIO,
+	RAWZ_IO_MMAP,
+	RAWZ_IO_DIRECT,
+	RAWZ_IO_ASYNC,
+} rawz_io_mode;
+
+typedef enum rawz_io_advice {
+	RAWZ_IO_ADVICE_NORMAL,
+	RAWZ_IO_ADVICE_SEQUENTIAL,
+	RAWZ_IO_ADVICE_RANDOM,
+	RAWZ_IO_ADVICE_WILLNEED,
+} rawz_io_advice;
+
+typedef struct rawz_io_options {
+	size_t size; /* sizeof(rawz_io_options), set by rawz_io_options_default. Members past size keep their defaults. */
+	rawz_io_mode mode;
+	rawz_io_advice advice; /* RAWZ_IO_MMAP only */
+	unsigned char populate; /* Prefault mapping (MAP_POPULATE). */
+	unsigned char hugepages; /* Request transparent hugepages. */
+	size_t buffer_size; /* Read buffer for RAWZ_IO_STDIO, staging buffer for RAWZ_IO_DIRECT. 0 = default */
+	unsigned queue_depth; /* Reads in flight for RAWZ_IO_ASYNC. 0 = default */
+	unsigned threads; /* Thread pool size if io_uring is unavailable, and decompression threads. 0 = default */
+	unsigned char fixed_buffers; /* Read through registered io_uring buffers. */
+	size_t backseek_bytes; /* Memory for backward seeks in non-seekable files. 0 = forward only */
+	uint64_t backseek_spill_bytes; /* Additional backward seek window in a temporary file. 0 = disabled */
+	unsigned char follow; /* Wait for a growing file instead of returning eof. Not supported by RAWZ_IO_MMAP. */
+	unsigned follow_timeout; /* Milliseconds to wait for more data. 0 = default (10 s) */
+	unsigned char compressed; /* Seekable zstd, or LZ4 frames with a zstd seek table. Offset is relative to the decompressed data. */
+	uint64_t max_bytes_per_sec; /* Reads are delayed to stay below the limit. 0 = unlimited */
+	unsigned max_iops; /* Read requests per second. 0 = unlimited */
+	unsigned char scheduled; /* Dispatch reads in file order together with other scheduled streams, e.g. on one hard disk. */
+	unsigned parallel_threads; /* Concurrent reads per frame, e.g. for striped NVMe. 0 = disabled */
+	size_t parallel_range_size; /* Frames are split into ranges of this size for parallel_threads. 0 = default (4 MiB) */
+	unsigned char lazy_open; /* Open the file on first read, and close it when too many lazy files are open. Seekable files only. */
+} rawz_io_options;
+
+typedef struct rawz_io_request {
+	uint64_t offset; /* Relative to the beginning of the stream. */
+	void *buf;
+	size_t n;
+} rawz_io_request;
+
 typedef int (*rawz_io_user_read)(void *buf, size_t n, void *user); /* 0 = success, positive = eof, negative = error */
+typedef int (*rawz_io_user_read_batch)(const rawz_io_request *req, size_t count, void *user); /* Same as rawz_io_user_read. */
 typedef int (*rawz_io_user_seek)(int64_t offset, int whence, void *user);
 typedef int64_t (*rawz_io_user_tell)(void *user);
 typedef void (*rawz_io_user_close)(void *user);
@@ -61,28 +105,135 @@ rawz_io_stream *rawz_io_open_file(const char *path, int seekable, uint64_t offse
 
 rawz_io_stream *rawz_io_open_fd(int fd, int seekable, uint64_t offset);
 
+/* Options may be NULL. Modes other than RAWZ_IO_STDIO fall back to stdio for non-seekable files. */
+rawz_io_stream *rawz_io_open_file2(const char *path, int seekable, uint64_t offset, const rawz_io_options *options);
+
+rawz_io_stream *rawz_io_open_fd2(int fd, int seekable, uint64_t offset, const rawz_io_options *options);
+
+/* Presents the concatenation of several files as one seekable stream. Offset is relative to the first file. */
+rawz_io_stream *rawz_io_open_segments(const char * const *paths, size_t count, uint64_t offset, const rawz_io_options *options);
+
 rawz_io_stream *rawz_io_wrap_user(rawz_io_user_read read, rawz_io_user_seek seek, rawz_io_user_tell tell, rawz_io_user_close close,
                                   int64_t length, void *user);
 
+/* Reads are positional, and a frame is passed to the callback as one list of requests, in any order.
+ * The callback may be called concurrently from multiple threads. Close may be NULL. */
+rawz_io_stream *rawz_io_wrap_user_batch(rawz_io_user_read_batch read_batch, rawz_io_user_close close, int64_t length, void *user);
+
+/* Shared memory ring buffer written by another process, e.g. a capture program. The stream is the concatenation of all
+ * published frames. Reads wait for unpublished frames up to options->follow_timeout, and fail for frames that have
+ * already been overwritten. Linux only. */
+rawz_io_stream *rawz_io_open_shm(const char *name, const rawz_io_options *options);
+
+rawz_io_stream *rawz_io_open_shm_fd(int fd, const rawz_io_options *options);
+
+/* Delays reads of io to stay below the given rates, e.g. for user streams. Takes ownership of io, or closes io on error.
+ * 0 = unlimited */
+rawz_io_stream *rawz_io_throttle(rawz_io_stream *io, uint64_t bytes_per_sec, unsigned iops);
+
+/* Limits shared by all streams opened while a limit is in effect, including user streams. Memory-mapped frames and
+ * shared memory are not limited. Takes effect immediately for those streams. 0 = unlimited */
+void rawz_set_process_io_limits(uint64_t bytes_per_sec, unsigned iops);
+
+/* Limit on the files held open by all streams opened with lazy_open. The least recently read files are closed and
+ * reopened when needed. Zero-copy access to memory-mapped files is not available for such streams. 0 = default (128) */
+void rawz_set_max_open_files(size_t count);
+
 void rawz_io_stream_close(rawz_io_stream *ptr);
 
 
+typedef struct rawz_shm_producer rawz_shm_producer;
+
+/* Creates a ring buffer of slot_count frames of slot_size bytes each. The shared memory object is not unlinked on free.
+ * The _fd variant takes ownership of a descriptor such as one returned by memfd_create. */
+rawz_shm_producer *rawz_shm_producer_create(const char *name, uint64_t slot_size, unsigned slot_count);
+
+rawz_shm_producer *rawz_shm_producer_create_fd(int fd, uint64_t slot_size, unsigned slot_count);
+
+/* Buffer for the next frame. Valid until rawz_shm_producer_publish. */
+void *rawz_shm_producer_slot(rawz_shm_producer *ptr);
+
+void rawz_shm_producer_publish(rawz_shm_producer *ptr);
+
+/* Readers waiting for further frames receive eof. */
+void rawz_shm_producer_free(rawz_shm_producer *ptr);
+
+
 typedef struct rawz_video_stream rawz_yuv_stream;
 
+#define RAWZ_MAX_HEADER_FIELDS 8
+
+typedef struct rawz_header_field {
+	unsigned offset; /* Relative to the beginning of the packet. */
+	unsigned size; /* 1 to 8 bytes */
+	unsigned char big_endian;
+} rawz_header_field;
+
+typedef struct rawz_stream_options {
+	size_t size; /* sizeof(rawz_stream_options), set by rawz_stream_options_default. Members past size keep their defaults. */
+	unsigned prefetch_depth; /* Frames to read ahead in the direction and stride of recent requests. 0 = disabled */
+	size_t prefetch_bytes; /* Memory limit for read-ahead. 0 = unlimited */
+	unsigned char drop_behind; /* Evict frames from the page cache once read. */
+	unsigned willneed_depth; /* Frames to announce to the page cache ahead of each read. 0 = disabled */
+	size_t cache_bytes; /* Memory limit for recently read frames, at least one frame. 0 = disabled */
+	int64_t framecount; /* Overrides the frame count. Required for non-seekable streams, upper bound for growing files. 0 = from length */
+	unsigned char sparse; /* Return frames in holes of sparse files as zeros without reading them. */
+	const uint64_t *frame_offsets; /* Byte offset of each packet, for files with gaps between frames. Copied. Not for Y4M. */
+	size_t frame_offsets_count; /* Number of frames in frame_offsets. */
+	const char *frame_offsets_path; /* Sidecar with one offset per line if the name ends in .txt, or little-endian uint64 otherwise. */
+	size_t packet_prefix; /* Bytes before each frame, e.g. a capture header. Not for Y4M. */
+	size_t packet_suffix; /* Bytes after each frame. Not for Y4M. */
+	rawz_header_field header_fields[RAWZ_MAX_HEADER_FIELDS]; /* Integers in the prefix returned in rawz_frame_info. */
+	unsigned header_field_count;
+} rawz_stream_options;
+
+typedef struct rawz_stream_stats {
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t read_requests; /* Byte ranges requested from the I/O backend. */
+	uint64_t read_calls; /* System calls or user callbacks issued to serve them, after merging adjacent ranges. */
+	uint64_t throttled_reads; /* Reads delayed by rate limits. */
+	uint64_t throttle_delay_us; /* Total time reads were delayed by rate limits. */
+} rawz_stream_stats;
+
+typedef struct rawz_frame_info {
+	unsigned char sparse; /* Frame lies in a hole of a sparse file, e.g. dropped or not yet captured. Planes are zero-filled. */
+	uint64_t header_fields[RAWZ_MAX_HEADER_FIELDS]; /* Values of rawz_stream_options.header_fields. Not set for sparse frames. */
+} rawz_frame_info;
+
 /* Takes ownership of io, or closes io on error. Updates format with actual parameters. */
 rawz_video_stream *rawz_video_stream_create(rawz_io_stream *io, rawz_format *format);
 
+/* Same as rawz_video_stream_create. Options may be NULL. */
+rawz_video_stream *rawz_video_stream_create2(rawz_io_stream *io, rawz_format *format, const rawz_stream_options *options);
+
+/* Re-evaluated from the current file length on each call if the stream was opened with follow. */
 int64_t rawz_video_stream_framecount(const rawz_video_stream *ptr);
 
 void rawz_video_stream_metadata(const rawz_video_stream *ptr, rawz_metadata *metadata);
 
+void rawz_video_stream_stats(const rawz_video_stream *ptr, rawz_stream_stats *stats);
+
+/* May be called concurrently from multiple threads, as may rawz_video_stream_read_info and rawz_video_stream_map.
+ * Non-seekable files and streams from rawz_io_wrap_user are read under a lock. */
 int rawz_video_stream_read(rawz_video_stream *ptr, int64_t n, void * const planes[4], const ptrdiff_t stride[4]);
 
+/* Same as rawz_video_stream_read. Also returns per-frame properties. */
+int rawz_video_stream_read_info(rawz_video_stream *ptr, int64_t n, void * const planes[4], const ptrdiff_t stride[4], rawz_frame_info *info);
+
+/* Zero-copy access to memory-mapped planar data. Pointers are valid until the stream is freed.
+ * Returns 0 on success, 1 on eof, and -1 on error or if the stream is not memory-mapped. */
+int rawz_video_stream_map(rawz_video_stream *ptr, int64_t n, const void *planes[4], ptrdiff_t stride[4]);
+
 void rawz_video_stream_free(rawz_video_stream *ptr);
 
 
 void rawz_format_default(rawz_format *ptr);
 
+void rawz_io_options_default(rawz_io_options *ptr);
+
+void rawz_stream_options_default(rawz_stream_options *ptr);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
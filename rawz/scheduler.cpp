@@ -0,0 +1,231 @@
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include "io.h"
+
+namespace rawz {
+
+namespace {
+
+// Few enough to preserve the dispatch order, and enough to keep the next read queued while one completes.
+constexpr unsigned worker_count = 2;
+
+// Bounds the reads dispatched together, so that other streams are not delayed for too long.
+constexpr size_t max_run_requests = 64;
+constexpr uint64_t max_run_bytes = 8UL << 20;
+
+
+// Dispatches positional reads from all scheduled streams in a one-way elevator order over (device, inode, offset),
+// so that concurrent streams on the same disk do not seek back and forth.
+class IOScheduler {
+	struct Batch {
+		size_t pending;
+		std::exception_ptr error;
+	};
+
+	struct Key {
+		uint64_t device;
+		uint64_t inode;
+		uint64_t offset;
+		uint64_t seq;
+
+		bool operator<(const Key &other) const
+		{
+			return std::tie(device, inode, offset, seq) < std::tie(other.device, other.inode, other.offset, other.seq);
+		}
+	};
+
+	struct Op {
+		IOStream *io;
+		IORequest req;
+		Batch *batch;
+	};
+
+	std::mutex m_mutex;
+	std::condition_variable m_work_cv;
+	std::condition_variable m_done_cv;
+	std::map<Key, Op> m_queue;
+	Key m_head;
+	uint64_t m_seq;
+	bool m_quit;
+	std::vector<std::thread> m_threads;
+
+	// Takes the next run of requests from one stream at or after the head, wrapping around at the end.
+	void take_run(std::vector<Op> &run)
+	{
+		auto it = m_queue.lower_bound(m_head);
+		if (it == m_queue.end())
+			it = m_queue.begin();
+
+		IOStream *io = it->second.io;
+		uint64_t bytes = 0;
+
+		while (it != m_queue.end() && it->second.io == io && run.size() < max_run_requests && bytes < max_run_bytes) {
+			bytes += it->second.req.n;
+			m_head = it->first;
+			run.push_back(it->second);
+			it = m_queue.erase(it);
+		}
+	}
+
+	void worker()
+	{
+		std::vector<Op> run;
+		std::vector<IORequest> req;
+		std::vector<std::exception_ptr> error;
+		std::unique_lock<std::mutex> lock{ m_mutex };
+
+		while (true) {
+			m_work_cv.wait(lock, [&]() { return m_quit || !m_queue.empty(); });
+			if (m_quit)
+				break;
+
+			run.clear();
+			take_run(run);
+			lock.unlock();
+
+			// The stream merges adjacent requests.
+			error.assign(run.size(), nullptr);
+			req.clear();
+			for (const Op &op : run) {
+				req.push_back(op.req);
+			}
+
+			try {
+				run.front().io->read_batch(req.data(), req.size());
+			} catch (...) {
+				// The run may combine several readers, so the failure is attributed to the individual requests.
+				for (size_t i = 0; i < run.size(); ++i) {
+					try {
+						run[i].io->read_batch(&run[i].req, 1);
+					} catch (...) {
+						error[i] = std::current_exception();
+					}
+				}
+			}
+
+			lock.lock();
+			for (size_t i = 0; i < run.size(); ++i) {
+				Batch *batch = run[i].batch;
+				if (error[i] && !batch->error)
+					batch->error = error[i];
+				--batch->pending;
+			}
+			m_done_cv.notify_all();
+		}
+	}
+public:
+	IOScheduler() : m_head{}, m_seq{}, m_quit{}
+	{
+		for (unsigned i = 0; i < worker_count; ++i) {
+			m_threads.emplace_back(&IOScheduler::worker, this);
+		}
+	}
+
+	IOScheduler(const IOScheduler &) = delete;
+
+	~IOScheduler()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			m_quit = true;
+		}
+		m_work_cv.notify_all();
+
+		for (std::thread &thread : m_threads) {
+			thread.join();
+		}
+	}
+
+	IOScheduler &operator=(const IOScheduler &) = delete;
+
+	// Reads from io, which must support concurrent positional reads. Blocks until all requests have completed.
+	void read(IOStream *io, uint64_t device, uint64_t inode, const IORequest *req, size_t count)
+	{
+		Batch batch{ count, nullptr };
+		std::unique_lock<std::mutex> lock{ m_mutex };
+
+		for (size_t i = 0; i < count; ++i) {
+			m_queue.emplace(Key{ device, inode, req[i].offset, m_seq++ }, Op{ io, req[i], &batch });
+		}
+		m_work_cv.notify_all();
+
+		m_done_cv.wait(lock, [&]() { return !batch.pending; });
+		if (batch.error)
+			std::rethrow_exception(batch.error);
+	}
+};
+
+IOScheduler &scheduler()
+{
+	static IOScheduler scheduler;
+	return scheduler;
+}
+
+
+class ScheduledIOStream : public IOStream {
+	std::unique_ptr<IOStream> m_io;
+	uint64_t m_device;
+	uint64_t m_inode;
+public:
+	ScheduledIOStream(std::unique_ptr<IOStream> io, uint64_t device, uint64_t inode) :
+		m_io{ std::move(io) },
+		m_device{ device },
+		m_inode{ inode }
+	{}
+
+	bool seekable() const override { return m_io->seekable(); }
+
+	void read(void *buf, size_t n) override { m_io->read(buf, n); }
+
+	void seek(int64_t offset, int whence) override { m_io->seek(offset, whence); }
+
+	uint64_t tell() const override { return m_io->tell(); }
+
+	uint64_t length() const override { return m_io->length(); }
+
+	void skip(size_t n) override { m_io->skip(n); }
+
+	void refresh() override { m_io->refresh(); }
+
+	const void *data() const noexcept override { return m_io->data(); }
+
+	rawz_stream_stats stats() const noexcept override { return m_io->stats(); }
+
+	void advise(uint64_t offset, uint64_t n, Advice advice) noexcept override { m_io->advise(offset, n, advice); }
+
+	bool is_hole(uint64_t offset, uint64_t n) noexcept override { return m_io->is_hole(offset, n); }
+
+	void release() noexcept override { m_io->release(); }
+
+	bool file_id(uint64_t &device, uint64_t &inode) const noexcept override { return m_io->file_id(device, inode); }
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		if (count)
+			scheduler().read(m_io.get(), m_device, m_inode, req, count);
+	}
+};
+
+} // namespace
+
+
+std::unique_ptr<IOStream> create_scheduled_stream(std::unique_ptr<IOStream> io)
+{
+	uint64_t device = 0;
+	uint64_t inode = 0;
+
+	// Memory-mapped files and pipes gain nothing from ordering.
+	if (!io->seekable() || io->data() || !io->file_id(device, inode))
+		return io;
+
+	return std::make_unique<ScheduledIOStream>(std::move(io), device, inode);
+}
+
+} // namespace rawz
@@ -0,0 +1,282 @@
+#ifdef __GNUC__
+  #define _FILE_OFFSET_BITS 64
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "io.h"
+
+#ifdef _WIN32
+  #include <filesystem>
+#endif
+
+namespace rawz {
+
+namespace {
+
+// Bounds the number of descriptors held by one stream.
+constexpr size_t max_open_segments = 4;
+
+
+uint64_t path_length(const std::string &path)
+{
+#ifdef _WIN32
+	return std::filesystem::file_size(std::filesystem::u8path(path));
+#else
+	struct stat st{};
+	if (stat(path.c_str(), &st))
+		throw std::system_error{ errno, std::generic_category(), path };
+	if (!S_ISREG(st.st_mode))
+		throw std::runtime_error{ "not a regular file: " + path };
+	return st.st_size;
+#endif
+}
+
+
+class SegmentedIOStream : public IOStream {
+	struct Segment {
+		std::string path;
+		uint64_t start;
+		uint64_t length;
+		std::shared_ptr<IOStream> io;
+		uint64_t last_use;
+	};
+
+	std::vector<Segment> m_segments;
+	rawz_io_options m_options;
+	uint64_t m_offset;
+	uint64_t m_length;
+	uint64_t m_where;
+
+	mutable std::mutex m_mutex;
+	uint64_t m_clock;
+	size_t m_open_count;
+	rawz_stream_stats m_closed_stats; // Counters of segments no longer open.
+
+	// Index of the segment containing an absolute position. Empty segments are never selected.
+	size_t find_segment(uint64_t pos) const
+	{
+		auto it = std::upper_bound(m_segments.begin(), m_segments.end(), pos, [](uint64_t pos, const Segment &seg) { return pos < seg.start; });
+		return static_cast<size_t>(it - m_segments.begin()) - 1;
+	}
+
+	std::shared_ptr<IOStream> acquire(size_t idx)
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		Segment &seg = m_segments[idx];
+
+		seg.last_use = ++m_clock;
+		if (seg.io)
+			return seg.io;
+
+		// Readers in other threads keep their reference to a closed segment until they are done.
+		if (m_open_count >= max_open_segments) {
+			auto lru = std::min_element(m_segments.begin(), m_segments.end(), [](const Segment &a, const Segment &b)
+			{
+				return (a.io ? a.last_use : UINT64_MAX) < (b.io ? b.last_use : UINT64_MAX);
+			});
+			add_stats(m_closed_stats, lru->io->stats());
+			lru->io.reset();
+			--m_open_count;
+		}
+
+		std::unique_ptr<IOStream> io = create_file_stream(seg.path.c_str(), true, 0, m_options);
+		if (io->length() != seg.length)
+			throw std::runtime_error{ "segment changed size: " + seg.path };
+
+		seg.io = std::move(io);
+		++m_open_count;
+		return seg.io;
+	}
+
+	void check_range(uint64_t offset, size_t n) const
+	{
+		if (offset > m_length - m_offset || n > m_length - m_offset - offset)
+			throw eof{};
+	}
+public:
+	SegmentedIOStream(std::vector<std::string> paths, uint64_t offset, const rawz_io_options &options) :
+		m_options(options),
+		m_offset{ offset },
+		m_length{},
+		m_where{},
+		m_clock{},
+		m_open_count{},
+		m_closed_stats{}
+	{
+		if (paths.empty())
+			throw std::runtime_error{ "no segments" };
+		if (options.compressed)
+			throw std::runtime_error{ "compressed segments not supported" };
+
+		// Segment lengths are fixed.
+		m_options.follow = 0;
+
+		// The stream limits and the read threads apply to all segments together.
+		m_options.max_bytes_per_sec = 0;
+		m_options.max_iops = 0;
+		m_options.parallel_threads = 0;
+
+		for (std::string &path : paths) {
+			uint64_t length = path_length(path);
+
+			if (length > UINT64_MAX - m_length)
+				throw std::runtime_error{ "total length out of bounds" };
+
+			m_segments.push_back({ std::move(path), m_length, length, nullptr, 0 });
+			m_length += length;
+		}
+
+		if (m_offset > m_length)
+			throw std::runtime_error{ "offset past end of file" };
+	}
+
+	bool seekable() const override { return true; }
+
+	void read(void *buf, size_t n) override
+	{
+		read_at(m_where, buf, n);
+		m_where += n;
+	}
+
+	void seek(int64_t offset, int whence) override
+	{
+		m_where = seek_address(offset, whence, 0, m_where, length());
+	}
+
+	uint64_t tell() const override { return m_where; }
+
+	uint64_t length() const override { return m_length - m_offset; }
+
+	rawz_stream_stats stats() const noexcept override
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		rawz_stream_stats stats = m_closed_stats;
+
+		for (const Segment &seg : m_segments) {
+			if (seg.io)
+				add_stats(stats, seg.io->stats());
+		}
+		return stats;
+	}
+
+	void advise(uint64_t offset, uint64_t n, Advice advice) noexcept override
+	{
+		if (offset > length())
+			return;
+
+		uint64_t pos = m_offset + offset;
+		uint64_t end = pos + std::min(n, length() - offset);
+
+		std::lock_guard<std::mutex> lock{ m_mutex };
+
+		// Advice is not worth opening a segment for.
+		for (size_t idx = find_segment(pos); idx < m_segments.size() && m_segments[idx].start < end; ++idx) {
+			const Segment &seg = m_segments[idx];
+			uint64_t first = std::max(pos, seg.start) - seg.start;
+			uint64_t last = std::min(end, seg.start + seg.length) - seg.start;
+
+			if (seg.io && first < last)
+				seg.io->advise(first, last - first, advice);
+		}
+	}
+
+	bool is_hole(uint64_t offset, uint64_t n) noexcept override
+	{
+		if (!n || offset > length() || n > length() - offset)
+			return false;
+
+		uint64_t pos = m_offset + offset;
+		size_t idx = find_segment(pos);
+		const Segment &seg = m_segments[idx];
+
+		// Ranges spanning segments are rare enough to be read normally.
+		if (n > seg.start + seg.length - pos)
+			return false;
+
+		try {
+			return acquire(idx)->is_hole(pos - seg.start, n);
+		} catch (...) {
+			return false;
+		}
+	}
+
+	void release() noexcept override
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+
+		for (Segment &seg : m_segments) {
+			if (seg.io) {
+				add_stats(m_closed_stats, seg.io->stats());
+				seg.io.reset();
+			}
+		}
+		m_open_count = 0;
+	}
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		// Requests are split at segment boundaries and grouped, so that each segment receives one batch.
+		std::vector<std::pair<size_t, IORequest>> split;
+
+		for (size_t i = 0; i < count; ++i) {
+			check_range(req[i].offset, req[i].n);
+
+			uint64_t pos = m_offset + req[i].offset;
+			unsigned char *buf = static_cast<unsigned char *>(req[i].buf);
+			size_t n = req[i].n;
+
+			while (n) {
+				size_t idx = find_segment(pos);
+				const Segment &seg = m_segments[idx];
+				size_t chunk = static_cast<size_t>(std::min(static_cast<uint64_t>(n), seg.start + seg.length - pos));
+
+				split.push_back({ idx, { pos - seg.start, buf, chunk } });
+				pos += chunk;
+				buf += chunk;
+				n -= chunk;
+			}
+		}
+
+		std::stable_sort(split.begin(), split.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+		std::vector<IORequest> batch;
+
+		for (auto it = split.begin(); it != split.end();) {
+			size_t idx = it->first;
+
+			batch.clear();
+			for (; it != split.end() && it->first == idx; ++it) {
+				batch.push_back(it->second);
+			}
+
+			acquire(idx)->read_batch(batch.data(), batch.size());
+		}
+	}
+};
+
+} // namespace
+
+
+std::unique_ptr<IOStream> create_segmented_stream(std::vector<std::string> paths, uint64_t offset, const rawz_io_options &options)
+{
+	std::unique_ptr<IOStream> stream = std::make_unique<SegmentedIOStream>(std::move(paths), offset, options);
+	stream = create_parallel_stream(std::move(stream), options.parallel_range_size, options.parallel_threads);
+
+	// Segments are throttled individually by the process limits.
+	if (options.max_bytes_per_sec || options.max_iops)
+		stream = create_throttle_stream(std::move(stream), options.max_bytes_per_sec, options.max_iops, false);
+	return stream;
+}
+
+} // namespace rawz
@@ -0,0 +1,336 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include "io.h"
+
+#ifdef __linux__
+  #include <fcntl.h>
+  #include <linux/futex.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/syscall.h>
+  #include <time.h>
+  #include <unistd.h>
+#endif
+
+namespace rawz {
+
+#ifdef __linux__
+namespace {
+
+constexpr uint32_t shm_magic = 0x5A574152; // "RAWZ"
+constexpr uint32_t shm_version = 1;
+constexpr size_t header_size = 4096;
+constexpr std::chrono::milliseconds default_timeout{ 10000 };
+
+
+// Start of the shared memory object. Frame n is stored in slot n % slot_count, following the header.
+struct ShmHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t slot_size;
+	uint64_t slot_count;
+	std::atomic<uint64_t> published; // Frames written so far.
+	std::atomic<uint32_t> futex; // Changes on every publish and on close.
+	std::atomic<uint32_t> waiters;
+	std::atomic<uint32_t> closed;
+};
+
+static_assert(sizeof(ShmHeader) <= header_size, "header too large");
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free, "atomics must be address-free");
+
+
+void futex_wait(std::atomic<uint32_t> *addr, uint32_t val, const timespec *timeout)
+{
+	// Wakeups may be spurious, so the result is not needed.
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT, val, timeout, nullptr, 0);
+}
+
+void futex_wake(std::atomic<uint32_t> *addr)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+uint64_t ring_size(uint64_t slot_size, uint64_t slot_count)
+{
+	if (!slot_size || !slot_count || slot_size > (static_cast<uint64_t>(INT64_MAX) - header_size) / slot_count)
+		throw std::runtime_error{ "invalid ring buffer size" };
+	if (header_size + slot_size * slot_count > SIZE_MAX)
+		throw std::runtime_error{ "ring buffer too large" };
+	return header_size + slot_size * slot_count;
+}
+
+int open_shm(const char *name, bool create)
+{
+	int fd = shm_open(name, create ? O_RDWR | O_CREAT : O_RDWR, 0600);
+	if (fd < 0)
+		throw std::system_error{ errno, std::generic_category(), name };
+	return fd;
+}
+
+
+class ShmMapping {
+	void *m_ptr;
+	size_t m_size;
+public:
+	ShmMapping(int fd, size_t size) : m_ptr{}, m_size{ size }
+	{
+		m_ptr = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (m_ptr == MAP_FAILED)
+			throw_system_error();
+	}
+
+	ShmMapping(const ShmMapping &) = delete;
+
+	~ShmMapping() { munmap(m_ptr, m_size); }
+
+	ShmMapping &operator=(const ShmMapping &) = delete;
+
+	ShmHeader *header() const { return static_cast<ShmHeader *>(m_ptr); }
+
+	unsigned char *slots() const { return static_cast<unsigned char *>(m_ptr) + header_size; }
+};
+
+
+// Reads frames from a ring buffer written by another process. The stream is the concatenation of all published frames.
+class ShmIOStream : public IOStream {
+	std::unique_ptr<ShmMapping> m_map;
+	ShmHeader *m_header;
+	uint64_t m_slot_size; // Copied from the header, which the producer could modify.
+	uint64_t m_slot_count;
+	std::chrono::milliseconds m_timeout;
+	uint64_t m_where;
+
+	void attach(int fd)
+	{
+		struct stat st{};
+		if (fstat(fd, &st))
+			throw_system_error();
+		if (static_cast<uint64_t>(st.st_size) < header_size)
+			throw std::runtime_error{ "not a rawz ring buffer" };
+
+		{
+			ShmMapping header_map{ fd, header_size };
+			const ShmHeader *header = header_map.header();
+
+			if (header->magic != shm_magic || header->version != shm_version)
+				throw std::runtime_error{ "not a rawz ring buffer" };
+
+			m_slot_size = header->slot_size;
+			m_slot_count = header->slot_count;
+		}
+
+		uint64_t size = ring_size(m_slot_size, m_slot_count);
+		if (static_cast<uint64_t>(st.st_size) < size)
+			throw std::runtime_error{ "truncated ring buffer" };
+
+		m_map = std::make_unique<ShmMapping>(fd, static_cast<size_t>(size));
+		m_header = m_map->header();
+	}
+
+	// Blocks until frame n has been published.
+	void wait_for_frame(uint64_t n) const
+	{
+		auto deadline = std::chrono::steady_clock::now() + m_timeout;
+
+		while (true) {
+			uint32_t seq = m_header->futex.load();
+			if (m_header->published.load(std::memory_order_acquire) > n)
+				break;
+			if (m_header->closed.load())
+				throw eof{};
+
+			auto now = std::chrono::steady_clock::now();
+			if (now >= deadline)
+				throw eof{};
+
+			auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now);
+			timespec ts{ static_cast<time_t>(remaining.count() / 1000000000), static_cast<long>(remaining.count() % 1000000000) };
+
+			// The producer only issues a system call if someone is waiting.
+			++m_header->waiters;
+			if (m_header->published.load() <= n)
+				futex_wait(&m_header->futex, seq, &ts);
+			--m_header->waiters;
+		}
+	}
+
+	void read_frame(uint64_t n, size_t offset, unsigned char *buf, size_t count) const
+	{
+		wait_for_frame(n);
+
+		// Once frame n + slot_count is being written, the slot of frame n is no longer intact.
+		if (m_header->published.load(std::memory_order_acquire) - n >= m_slot_count)
+			throw std::runtime_error{ "frame no longer in ring buffer" };
+
+		std::memcpy(buf, m_map->slots() + (n % m_slot_count) * m_slot_size + offset, count);
+
+		// The producer may have started to overwrite the slot during the copy.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (m_header->published.load(std::memory_order_relaxed) >= n + m_slot_count)
+			throw std::runtime_error{ "frame overwritten during read" };
+	}
+public:
+	ShmIOStream(int fd, unsigned timeout_ms) try :
+		m_header{},
+		m_slot_size{},
+		m_slot_count{},
+		m_timeout{ timeout_ms ? std::chrono::milliseconds{ timeout_ms } : default_timeout },
+		m_where{}
+	{
+		attach(fd);
+		close(fd);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+
+	bool seekable() const override { return true; }
+
+	void read(void *buf, size_t n) override
+	{
+		read_at(m_where, buf, n);
+		m_where += n;
+	}
+
+	void seek(int64_t offset, int whence) override
+	{
+		m_where = seek_address(offset, whence, 0, m_where, length());
+	}
+
+	uint64_t tell() const override { return m_where; }
+
+	uint64_t length() const override { return m_header->published.load() * m_slot_size; }
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		m_read_requests += count;
+
+		for (size_t i = 0; i < count; ++i) {
+			if (req[i].n > UINT64_MAX - req[i].offset)
+				throw eof{};
+
+			uint64_t pos = req[i].offset;
+			unsigned char *buf = static_cast<unsigned char *>(req[i].buf);
+			size_t n = req[i].n;
+
+			while (n) {
+				size_t offset = static_cast<size_t>(pos % m_slot_size);
+				size_t chunk = static_cast<size_t>(std::min(static_cast<uint64_t>(n), m_slot_size - offset));
+
+				read_frame(pos / m_slot_size, offset, buf, chunk);
+				pos += chunk;
+				buf += chunk;
+				n -= chunk;
+			}
+		}
+	}
+};
+
+
+class ShmProducerImpl : public ShmProducer {
+	std::unique_ptr<ShmMapping> m_map;
+	ShmHeader *m_header;
+	uint64_t m_slot_size;
+	uint64_t m_slot_count;
+	uint64_t m_published;
+
+	void notify()
+	{
+		++m_header->futex;
+		if (m_header->waiters.load())
+			futex_wake(&m_header->futex);
+	}
+public:
+	ShmProducerImpl(int fd, uint64_t slot_size, unsigned slot_count) try :
+		m_header{},
+		m_slot_size{ slot_size },
+		m_slot_count{ slot_count },
+		m_published{}
+	{
+		uint64_t size = ring_size(slot_size, slot_count);
+		if (ftruncate(fd, static_cast<off_t>(size)))
+			throw_system_error();
+
+		m_map = std::make_unique<ShmMapping>(fd, static_cast<size_t>(size));
+
+		// The magic is written last, so that readers do not attach to a partial header.
+		m_header = new (m_map->header()) ShmHeader{ 0, shm_version, slot_size, slot_count, {}, {}, {}, {} };
+		std::atomic_thread_fence(std::memory_order_release);
+		m_header->magic = shm_magic;
+
+		close(fd);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+
+	~ShmProducerImpl()
+	{
+		m_header->closed = 1;
+		notify();
+	}
+
+	void *slot() override { return m_map->slots() + (m_published % m_slot_count) * m_slot_size; }
+
+	void publish() override
+	{
+		m_header->published.store(++m_published, std::memory_order_release);
+		notify();
+	}
+};
+
+} // namespace
+
+
+std::unique_ptr<IOStream> create_shm_stream(const char *name, unsigned timeout_ms)
+{
+	return create_shm_stream_fd(open_shm(name, false), timeout_ms);
+}
+
+std::unique_ptr<IOStream> create_shm_stream_fd(int fd, unsigned timeout_ms)
+{
+	return std::make_unique<ShmIOStream>(fd, timeout_ms);
+}
+
+std::unique_ptr<ShmProducer> create_shm_producer(const char *name, uint64_t slot_size, unsigned slot_count)
+{
+	return create_shm_producer_fd(open_shm(name, true), slot_size, slot_count);
+}
+
+std::unique_ptr<ShmProducer> create_shm_producer_fd(int fd, uint64_t slot_size, unsigned slot_count)
+{
+	return std::make_unique<ShmProducerImpl>(fd, slot_size, slot_count);
+}
+#else
+std::unique_ptr<IOStream> create_shm_stream(const char *name, unsigned timeout_ms)
+{
+	throw std::runtime_error{ "shared memory input not supported on this platform" };
+}
+
+std::unique_ptr<IOStream> create_shm_stream_fd(int fd, unsigned timeout_ms)
+{
+	throw std::runtime_error{ "shared memory input not supported on this platform" };
+}
+
+std::unique_ptr<ShmProducer> create_shm_producer(const char *name, uint64_t slot_size, unsigned slot_count)
+{
+	throw std::runtime_error{ "shared memory input not supported on this platform" };
+}
+
+std::unique_ptr<ShmProducer> create_shm_producer_fd(int fd, uint64_t slot_size, unsigned slot_count)
+{
+	throw std::runtime_error{ "shared memory input not supported on this platform" };
+}
+#endif // __linux__
+
+} // namespace rawz
@@ -0,0 +1,89 @@
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include "common.h"
+#include "io.h"
+#include "stream.h"
+
+namespace rawz {
+
+namespace {
+
+constexpr unsigned MAX_PLANES = 4;
+
+
+// Capture programs preallocate sparse files and leave holes for dropped frames. Such frames read as zeros anyway,
+// so they are produced without any I/O.
+class SparseVideoStream : public VideoStream {
+	std::unique_ptr<VideoStream> m_stream;
+	IOStream *m_io;
+	size_t m_rowsize[MAX_PLANES];
+	unsigned m_height[MAX_PLANES];
+
+	void zero_fill(void * const planes[4], const ptrdiff_t stride[4]) const
+	{
+		for (unsigned p = 0; p < MAX_PLANES; ++p) {
+			if (!planes[p] || !m_rowsize[p])
+				continue;
+
+			void *dst = planes[p];
+
+			for (unsigned i = 0; i < m_height[p]; ++i) {
+				std::memset(dst, 0, m_rowsize[p]);
+				dst = advance_ptr(dst, stride[p]);
+			}
+		}
+	}
+public:
+	SparseVideoStream(std::unique_ptr<VideoStream> stream, IOStream *io, const rawz_format &format) :
+		m_stream{ std::move(stream) },
+		m_io{ io },
+		m_rowsize{},
+		m_height{}
+	{
+		for (unsigned p = 0; p < MAX_PLANES; ++p) {
+			if (!(format.planes_mask & (1U << p)))
+				continue;
+
+			unsigned width = is_chroma_plane(p) ? subsampled_dim(format.width, format.subsample_w) : format.width;
+			m_rowsize[p] = static_cast<size_t>(width) * format.bytes_per_sample;
+			m_height[p] = is_chroma_plane(p) ? subsampled_dim(format.height, format.subsample_h) : format.height;
+		}
+	}
+
+	int64_t framecount() const noexcept override { return m_stream->framecount(); }
+
+	rawz_metadata metadata() const noexcept override { return m_stream->metadata(); }
+
+	rawz_stream_stats stats() const noexcept override { return m_stream->stats(); }
+
+	uint64_t packet_offset(int64_t n) const override { return m_stream->packet_offset(n); }
+
+	uint64_t packet_size() const noexcept override { return m_stream->packet_size(); }
+
+	void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4], rawz_frame_info *info) override
+	{
+		if (n >= 0 && n < framecount() && m_io->is_hole(packet_offset(n), packet_size())) {
+			zero_fill(planes, stride);
+			info->sparse = 1;
+			return;
+		}
+
+		m_stream->read(n, planes, stride, info);
+	}
+
+	bool map(int64_t n, const void *planes[4], ptrdiff_t stride[4]) override
+	{
+		return m_stream->map(n, planes, stride);
+	}
+};
+
+} // namespace
+
+
+std::unique_ptr<VideoStream> create_sparse_stream(std::unique_ptr<VideoStream> stream, IOStream *io, const rawz_format &format)
+{
+	return std::make_unique<SparseVideoStream>(std::move(stream), io, format);
+}
+
+} // namespace rawz
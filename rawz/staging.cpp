@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include "staging.h"
+
+#ifdef _WIN32
+  #include <malloc.h>
+#else
+  #include <sys/mman.h>
+#endif
+
+namespace rawz {
+
+namespace {
+
+constexpr size_t hugepage_size = 2UL << 20;
+
+// Enough for every thread reading concurrently from one stream in a typical host.
+constexpr size_t max_free_buffers = 16;
+
+
+unsigned char *allocate(size_t size, size_t &capacity)
+{
+	// Large buffers are aligned to the hugepage size, so that the kernel can back them with hugepages.
+	size_t align = size >= hugepage_size ? hugepage_size : static_cast<size_t>(1) << StagingPool::log2_alignment;
+
+	if (size > SIZE_MAX - (align - 1))
+		throw std::bad_alloc{};
+	capacity = (size + align - 1) / align * align;
+
+#ifdef _WIN32
+	void *ptr = _aligned_malloc(capacity, align);
+	if (!ptr)
+		throw std::bad_alloc{};
+#else
+	void *ptr = nullptr;
+	if (posix_memalign(&ptr, align, capacity))
+		throw std::bad_alloc{};
+  #ifdef MADV_HUGEPAGE
+	if (align == hugepage_size)
+		madvise(ptr, capacity, MADV_HUGEPAGE);
+  #endif
+#endif
+	return static_cast<unsigned char *>(ptr);
+}
+
+void deallocate(unsigned char *ptr)
+{
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	std::free(ptr);
+#endif
+}
+
+} // namespace
+
+
+StagingBuffer::~StagingBuffer()
+{
+	if (m_data)
+		m_pool->release(m_data, m_capacity);
+}
+
+
+StagingPool::StagingPool()
+{
+	m_free.reserve(max_free_buffers);
+}
+
+StagingPool::~StagingPool()
+{
+	for (const Block &block : m_free) {
+		deallocate(block.data);
+	}
+}
+
+StagingBuffer StagingPool::acquire(size_t size)
+{
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		auto best = m_free.end();
+
+		for (auto it = m_free.begin(); it != m_free.end(); ++it) {
+			if (it->capacity >= size && (best == m_free.end() || it->capacity < best->capacity))
+				best = it;
+		}
+
+		if (best != m_free.end()) {
+			Block block = *best;
+			m_free.erase(best);
+			return{ this, block.data, block.capacity };
+		}
+	}
+
+	size_t capacity = 0;
+	unsigned char *data = allocate(size, capacity);
+	return{ this, data, capacity };
+}
+
+void StagingPool::release(unsigned char *data, size_t capacity) noexcept
+{
+	std::unique_lock<std::mutex> lock{ m_mutex };
+
+	if (m_free.size() < max_free_buffers) {
+		m_free.push_back({ data, capacity });
+		return;
+	}
+
+	// Keep the larger buffers, which are more expensive to fault in.
+	Block evicted{ data, capacity };
+	auto smallest = std::min_element(m_free.begin(), m_free.end(), [](const Block &a, const Block &b) { return a.capacity < b.capacity; });
+	if (smallest->capacity < capacity)
+		std::swap(*smallest, evicted);
+
+	lock.unlock();
+	deallocate(evicted.data);
+}
+
+} // namespace rawz
@@ -0,0 +1,68 @@
+#pragma once
+
+#ifndef RAWZ_STAGING_H_
+#define RAWZ_STAGING_H_
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace rawz {
+
+class StagingPool;
+
+// Buffer borrowed from a StagingPool. Returned to the pool on destruction.
+class StagingBuffer {
+	StagingPool *m_pool;
+	unsigned char *m_data;
+	size_t m_capacity;
+public:
+	StagingBuffer(StagingPool *pool, unsigned char *data, size_t capacity) : m_pool{ pool }, m_data{ data }, m_capacity{ capacity } {}
+
+	StagingBuffer(StagingBuffer &&other) noexcept : m_pool{ other.m_pool }, m_data{ other.m_data }, m_capacity{ other.m_capacity }
+	{
+		other.m_data = nullptr;
+	}
+
+	~StagingBuffer();
+
+	StagingBuffer &operator=(StagingBuffer &&) = delete;
+
+	unsigned char *data() const { return m_data; }
+
+	size_t capacity() const { return m_capacity; }
+};
+
+// Recycles 64-byte aligned buffers for data that is unpacked after reading, so that steady-state reads neither
+// allocate nor fault in fresh pages. Buffers of 2 MiB or more are backed by transparent hugepages where available.
+// Thread-safe.
+class StagingPool {
+	struct Block {
+		unsigned char *data;
+		size_t capacity;
+	};
+
+	std::mutex m_mutex;
+	std::vector<Block> m_free;
+
+	void release(unsigned char *data, size_t capacity) noexcept;
+
+	friend class StagingBuffer;
+public:
+	// Sub-buffers carved from one allocation should start at a multiple of the alignment.
+	static constexpr unsigned log2_alignment = 6;
+
+	StagingPool();
+
+	StagingPool(const StagingPool &) = delete;
+
+	~StagingPool();
+
+	StagingPool &operator=(const StagingPool &) = delete;
+
+	StagingBuffer acquire(size_t size);
+};
+
+} // namespace rawz
+
+#endif // RAWZ_STAGING_H_
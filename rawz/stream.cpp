@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <stdexcept>
 #include "checked_int.h"
 #include "common.h"
 #include "io.h"
@@ -9,9 +11,112 @@ namespace {
 
 constexpr unsigned MAX_PLANES = 4;
 
+
+// Reports a frame count given by the caller.
+class FixedLengthVideoStream : public VideoStream {
+	std::unique_ptr<VideoStream> m_stream;
+	int64_t m_framecount;
+public:
+	FixedLengthVideoStream(std::unique_ptr<VideoStream> stream, int64_t framecount) :
+		m_stream{ std::move(stream) },
+		m_framecount{ framecount }
+	{}
+
+	int64_t framecount() const noexcept override { return m_framecount; }
+
+	rawz_metadata metadata() const noexcept override { return m_stream->metadata(); }
+
+	rawz_stream_stats stats() const noexcept override { return m_stream->stats(); }
+
+	uint64_t packet_offset(int64_t n) const override { return m_stream->packet_offset(n); }
+
+	uint64_t packet_size() const noexcept override { return m_stream->packet_size(); }
+
+	void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4], rawz_frame_info *info) override
+	{
+		if (n < 0 || n >= m_framecount)
+			throw IOStream::eof{};
+		m_stream->read(n, planes, stride, info);
+	}
+
+	bool map(int64_t n, const void *planes[4], ptrdiff_t stride[4]) override
+	{
+		if (n < 0 || n >= m_framecount)
+			throw IOStream::eof{};
+		return m_stream->map(n, planes, stride);
+	}
+};
+
 } // namespace
 
 
+PacketLayout::PacketLayout() : m_prefix{}, m_suffix{}, m_header_size{} {}
+
+PacketLayout::PacketLayout(std::shared_ptr<const OffsetTable> table, size_t prefix, size_t suffix, const rawz_header_field *fields, unsigned field_count) :
+	m_table{ std::move(table) },
+	m_prefix{ prefix },
+	m_suffix{ suffix },
+	m_header_size{}
+{
+	if (field_count > RAWZ_MAX_HEADER_FIELDS)
+		throw std::runtime_error{ "too many header fields" };
+
+	for (unsigned i = 0; i < field_count; ++i) {
+		const rawz_header_field &field = fields[i];
+
+		if (!field.size || field.size > 8 || field.offset > m_prefix || field.size > m_prefix - field.offset)
+			throw std::runtime_error{ "header field outside of packet prefix" };
+
+		m_fields.push_back(field);
+		m_header_size = std::max(m_header_size, static_cast<size_t>(field.offset) + field.size);
+	}
+}
+
+uint64_t PacketLayout::packet_size(uint64_t frame_size) const
+{
+	if (m_prefix > UINT64_MAX - frame_size || m_suffix > UINT64_MAX - frame_size - m_prefix)
+		throw std::runtime_error{ "packet size out of bounds" };
+	return m_prefix + frame_size + m_suffix;
+}
+
+int64_t PacketLayout::framecount(const IOStream &io, uint64_t packet_size) const noexcept
+{
+	if (m_table)
+		return m_table->size();
+	return io.seekable() ? io.length() / packet_size : 0;
+}
+
+uint64_t PacketLayout::packet_offset(int64_t n, uint64_t packet_size) const
+{
+	uint64_t offset = m_table ? m_table->offset(n) : frame_offset(n, packet_size);
+	if (offset > UINT64_MAX - packet_size)
+		throw IOStream::eof{};
+	return offset;
+}
+
+void PacketLayout::header_request(std::vector<IORequest> &req, uint64_t offset, void *buf) const
+{
+	if (m_header_size)
+		req.push_back({ offset, buf, m_header_size });
+}
+
+void PacketLayout::decode_header(const void *buf, rawz_frame_info *info) const
+{
+	const unsigned char *ptr = static_cast<const unsigned char *>(buf);
+
+	for (size_t i = 0; i < m_fields.size(); ++i) {
+		const rawz_header_field &field = m_fields[i];
+		uint64_t value = 0;
+
+		for (unsigned k = 0; k < field.size; ++k) {
+			unsigned idx = field.big_endian ? k : field.size - 1 - k;
+			value = (value << 8) | ptr[field.offset + idx];
+		}
+		info->header_fields[i] = value;
+	}
+}
+
+
 rawz_metadata default_metadata()
 {
 	rawz_metadata metadata{};
@@ -59,30 +164,25 @@ size_t planar_frame_size(const rawz_format &format)
 	return sz.get();
 }
 
-void skip_plane(IOStream *io, unsigned width, unsigned height, unsigned bytes_per_sample, unsigned alignment)
+void plane_requests(std::vector<IORequest> &req, uint64_t offset, unsigned width, unsigned height, unsigned bytes_per_sample, unsigned alignment, void *dst, ptrdiff_t stride)
 {
 	checked_size_t rowsize = checked_size_t{ width } * bytes_per_sample;
 	checked_size_t rowsize_aligned = ceil_aligned(rowsize, alignment);
-	checked_size_t n = rowsize_aligned * height;
-	io->skip(n.get());
-}
 
-void blit_plane(IOStream *io, unsigned width, unsigned height, unsigned bytes_per_sample, unsigned alignment, void *dst, ptrdiff_t stride)
-{
-	checked_size_t rowsize = checked_size_t{ width } * bytes_per_sample;
-	checked_size_t rowsize_aligned = ceil_aligned(rowsize, alignment);
-	size_t diff = rowsize_aligned.get() - rowsize.get();
+	// The padding of all rows but the last fits into the destination, so the plane is read in one request.
+	if (height && stride == static_cast<ptrdiff_t>(rowsize_aligned.get())) {
+		req.push_back({ offset, dst, (rowsize_aligned * (height - 1) + rowsize).get() });
+		return;
+	}
 
+	// Otherwise, rows are merged by the I/O backend.
 	for (unsigned i = 0; i < height; ++i) {
-		io->read(dst, rowsize.get());
-		if (diff)
-			io->skip(diff);
-
+		req.push_back({ offset + static_cast<uint64_t>(i) * rowsize_aligned.get(), dst, rowsize.get() });
 		dst = advance_ptr(dst, stride);
 	}
 }
 
-void blit_planar_frame(IOStream *io, const rawz_format &format, void * const planes[4], const ptrdiff_t stride[4])
+void planar_frame_requests(std::vector<IORequest> &req, uint64_t offset, const rawz_format &format, void * const planes[4], const ptrdiff_t stride[4])
 {
 	for (unsigned p = 0; p < MAX_PLANES; ++p) {
 		if (!(format.planes_mask & (1U << p)))
@@ -90,12 +190,65 @@ void blit_planar_frame(IOStream *io, const rawz_format &format, void * const pla
 
 		unsigned width = is_chroma_plane(p) ? subsampled_dim(format.width, format.subsample_w) : format.width;
 		unsigned height = is_chroma_plane(p) ? subsampled_dim(format.height, format.subsample_h) : format.height;
+		checked_size_t rowsize_aligned = ceil_aligned(checked_size_t{ width } * format.bytes_per_sample, format.alignment);
 
 		if (planes[p])
-			blit_plane(io, width, height, format.bytes_per_sample, format.alignment, planes[p], stride[p]);
-		else
-			skip_plane(io, format.width, height, format.bytes_per_sample, format.alignment);
+			plane_requests(req, offset, width, height, format.bytes_per_sample, format.alignment, planes[p], stride[p]);
+
+		offset += (rowsize_aligned * height).get();
 	}
 }
 
+void map_planar_frame(const void *data, const rawz_format &format, const void *planes[4], ptrdiff_t stride[4])
+{
+	for (unsigned p = 0; p < MAX_PLANES; ++p) {
+		planes[p] = nullptr;
+		stride[p] = 0;
+
+		if (!(format.planes_mask & (1U << p)))
+			continue;
+
+		unsigned width = is_chroma_plane(p) ? subsampled_dim(format.width, format.subsample_w) : format.width;
+		unsigned height = is_chroma_plane(p) ? subsampled_dim(format.height, format.subsample_h) : format.height;
+		checked_size_t rowsize = ceil_aligned(checked_size_t{ width } * format.bytes_per_sample, format.alignment);
+
+		planes[p] = data;
+		stride[p] = static_cast<ptrdiff_t>(rowsize.get());
+		data = advance_ptr(data, (rowsize * height).get());
+	}
+}
+
+
+std::unique_ptr<VideoStream> create_video_stream(std::unique_ptr<IOStream> io, rawz_format *format, const PacketLayout &layout)
+{
+	if (layout.table() && !io->seekable())
+		throw std::runtime_error{ "offset table requires a seekable file" };
+
+	switch (format->mode) {
+	case RAWZ_PLANAR:
+		return create_planar_stream(std::move(io), format, layout);
+	case RAWZ_Y4M:
+		if (!layout.is_default())
+			throw std::runtime_error{ "packet layout not supported for Y4M" };
+		return create_y4m_stream(std::move(io), format);
+	case RAWZ_NV:
+		return create_nv_stream(std::move(io), format, layout);
+	case RAWZ_ARGB:
+	case RAWZ_RGBA:
+	case RAWZ_RGB:
+	case RAWZ_RGB30:
+	case RAWZ_YUYV:
+	case RAWZ_UYVY:
+	case RAWZ_V210:
+		return create_interleaved_stream(std::move(io), format, layout);
+	default:
+		throw std::runtime_error{ "unsupported packing mode" };
+	}
+}
+
+std::unique_ptr<VideoStream> create_fixed_length_stream(std::unique_ptr<VideoStream> stream, int64_t framecount)
+{
+	return std::make_unique<FixedLengthVideoStream>(std::move(stream), framecount);
+}
+
 } // namespace rawz
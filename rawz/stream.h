@@ -4,7 +4,9 @@
 #define RAWZ_STREAM_H_
 
 #include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <vector>
 #include "rawz.h"
 
 struct rawz_video_stream {
@@ -16,16 +18,92 @@ protected:
 namespace rawz {
 
 class IOStream;
+struct IORequest;
+
+// Locations of the frames in the I/O stream, for files with gaps or padding between frames.
+class OffsetTable {
+	std::unique_ptr<IOStream> m_file;
+	std::vector<uint64_t> m_offsets;
+	const unsigned char *m_data; // Little-endian table in m_file, if memory-mapped.
+	int64_t m_size;
+public:
+	explicit OffsetTable(std::vector<uint64_t> offsets);
+
+	// Reads a table of little-endian 64-bit offsets.
+	explicit OffsetTable(std::unique_ptr<IOStream> file);
+
+	OffsetTable(const OffsetTable &) = delete;
+
+	~OffsetTable();
+
+	OffsetTable &operator=(const OffsetTable &) = delete;
+
+	int64_t size() const noexcept { return m_size; }
+
+	// Throws IOStream::eof if n is out of range.
+	uint64_t offset(int64_t n) const;
+};
+
+
+// Helper class. Locates the packets of a stream, consisting of an optional prefix such as a capture header, the frame
+// data, and an optional suffix. Decodes fields of the prefix into rawz_frame_info.
+class PacketLayout {
+	std::shared_ptr<const OffsetTable> m_table;
+	size_t m_prefix;
+	size_t m_suffix;
+	std::vector<rawz_header_field> m_fields;
+	size_t m_header_size; // Leading bytes of the prefix that contain fields.
+public:
+	PacketLayout();
+
+	// Packets are consecutive if table is nullptr.
+	PacketLayout(std::shared_ptr<const OffsetTable> table, size_t prefix, size_t suffix, const rawz_header_field *fields, unsigned field_count);
+
+	bool is_default() const noexcept { return !m_table && !m_prefix && !m_suffix; }
+
+	const OffsetTable *table() const noexcept { return m_table.get(); }
+
+	size_t prefix() const noexcept { return m_prefix; }
+
+	size_t header_size() const noexcept { return m_header_size; }
+
+	// Packet size for frame_size bytes of frame data.
+	uint64_t packet_size(uint64_t frame_size) const;
+
+	int64_t framecount(const IOStream &io, uint64_t packet_size) const noexcept;
 
+	// Throws IOStream::eof on overflow.
+	uint64_t packet_offset(int64_t n, uint64_t packet_size) const;
+
+	// Appends the read of the header fields of a packet into buf, which holds header_size() bytes.
+	void header_request(std::vector<IORequest> &req, uint64_t offset, void *buf) const;
+
+	void decode_header(const void *buf, rawz_frame_info *info) const;
+};
+
+// Streams are stateless. read() and map() may be called concurrently from multiple threads.
 class VideoStream : public rawz_video_stream {
 public:
+	virtual ~VideoStream() = default;
+
 	VideoStream &operator=(const VideoStream &) = delete;
 
 	virtual int64_t framecount() const noexcept = 0;
 
 	virtual rawz_metadata metadata() const noexcept = 0;
 
-	virtual void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4]) = 0;
+	virtual rawz_stream_stats stats() const noexcept { return rawz_stream_stats{}; }
+
+	// Location of frame n within the I/O stream. Throws IOStream::eof on overflow.
+	virtual uint64_t packet_offset(int64_t n) const = 0;
+
+	virtual uint64_t packet_size() const noexcept = 0;
+
+	// Fields of info that do not apply to the stream are left unchanged.
+	virtual void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4], rawz_frame_info *info) = 0;
+
+	// Returns pointers into the stream contents if memory-mapped, or false.
+	virtual bool map(int64_t /*n*/, const void * /*planes*/[4], ptrdiff_t /*stride*/[4]) { return false; }
 };
 
 
@@ -37,21 +115,50 @@ bool is_valid_format(const rawz_format &format);
 
 size_t planar_frame_size(const rawz_format &format);
 
-void skip_plane(IOStream *io, unsigned width, unsigned height, unsigned bytes_per_sample, unsigned alignment);
+// Appends the reads for one plane at the given offset. Planes with a matching stride are read in one request.
+void plane_requests(std::vector<IORequest> &req, uint64_t offset, unsigned width, unsigned height, unsigned bytes_per_sample, unsigned alignment, void *dst, ptrdiff_t stride);
 
-void blit_plane(IOStream *io, unsigned width, unsigned height, unsigned bytes_per_sample, unsigned alignment, void *dst, ptrdiff_t stride);
+// Appends the reads for a planar frame at the given offset. Planes that are nullptr are not read.
+void planar_frame_requests(std::vector<IORequest> &req, uint64_t offset, const rawz_format &format, void * const planes[4], const ptrdiff_t stride[4]);
 
-void blit_planar_frame(IOStream *io, const rawz_format &format, void * const planes[4], const ptrdiff_t stride[4]);
+void map_planar_frame(const void *data, const rawz_format &format, const void *planes[4], ptrdiff_t stride[4]);
 
 
-std::unique_ptr<VideoStream> create_planar_stream(std::unique_ptr<IOStream> io, const rawz_format *format);
+// Copies count offsets.
+std::shared_ptr<const OffsetTable> create_offset_table(const uint64_t *offsets, size_t count);
 
-std::unique_ptr<VideoStream> create_nv_stream(std::unique_ptr<IOStream> io, rawz_format *format);
+// Text with one offset per line if the name ends in .txt, or little-endian 64-bit offsets otherwise.
+std::shared_ptr<const OffsetTable> load_offset_table(const char *path);
 
-std::unique_ptr<VideoStream> create_interleaved_stream(std::unique_ptr<IOStream> io, rawz_format *format);
+std::unique_ptr<VideoStream> create_planar_stream(std::unique_ptr<IOStream> io, const rawz_format *format, const PacketLayout &layout);
+
+std::unique_ptr<VideoStream> create_nv_stream(std::unique_ptr<IOStream> io, rawz_format *format, const PacketLayout &layout);
+
+std::unique_ptr<VideoStream> create_interleaved_stream(std::unique_ptr<IOStream> io, rawz_format *format, const PacketLayout &layout);
 
 std::unique_ptr<VideoStream> create_y4m_stream(std::unique_ptr<IOStream> io, rawz_format *format);
 
+// Selects the stream type from the packing mode. Y4M packets can not have a different layout.
+std::unique_ptr<VideoStream> create_video_stream(std::unique_ptr<IOStream> io, rawz_format *format, const PacketLayout &layout = PacketLayout{});
+
+// Overrides the frame count, e.g. for non-seekable streams.
+std::unique_ptr<VideoStream> create_fixed_length_stream(std::unique_ptr<VideoStream> stream, int64_t framecount);
+
+// Reads up to depth frames ahead on a background thread when access is sequential.
+std::unique_ptr<VideoStream> create_prefetch_stream(std::unique_ptr<IOStream> io, rawz_format *format, const PacketLayout &layout,
+                                                   unsigned depth, size_t max_bytes);
+
+// Evicts frames from the page cache once read, and announces up to willneed_depth frames ahead.
+// The I/O stream must be owned by the video stream.
+std::unique_ptr<VideoStream> create_advised_stream(std::unique_ptr<VideoStream> stream, IOStream *io, bool drop_behind, unsigned willneed_depth);
+
+// Zero-fills frames whose packet lies in a hole of the I/O stream, without reading it.
+// The I/O stream must be owned by the video stream. The format must be the one reported by the stream.
+std::unique_ptr<VideoStream> create_sparse_stream(std::unique_ptr<VideoStream> stream, IOStream *io, const rawz_format &format);
+
+// Keeps unpacked frames in memory up to max_bytes. The format must be the one reported by the stream.
+std::unique_ptr<VideoStream> create_cached_stream(std::unique_ptr<VideoStream> stream, const rawz_format &format, size_t max_bytes);
+
 } // namespace rawz
 
 #endif // RAWZ_STREAM_H_
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "io.h"
+
+namespace rawz {
+
+namespace {
+
+typedef std::chrono::steady_clock clock_type;
+
+// Tokens accumulated while idle, so that short bursts are not delayed.
+constexpr double burst_seconds = 0.1;
+
+
+// Hands out tokens at a fixed rate. Callers that exceed the rate borrow tokens and wait until they are repaid,
+// so that concurrent readers queue behind each other instead of failing.
+class TokenBucket {
+	std::mutex m_mutex;
+	double m_rate;
+	double m_tokens;
+	clock_type::time_point m_last;
+public:
+	TokenBucket() : m_rate{}, m_tokens{}, m_last{ clock_type::now() } {}
+
+	void set_rate(uint64_t rate)
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+
+		// A newly limited bucket starts full.
+		m_tokens = m_rate ? std::min(m_tokens, rate * burst_seconds) : rate * burst_seconds;
+		m_rate = static_cast<double>(rate);
+		m_last = clock_type::now();
+	}
+
+	// Returns how long the caller must wait before using the tokens.
+	clock_type::duration reserve(uint64_t n)
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		if (!m_rate)
+			return clock_type::duration::zero();
+
+		clock_type::time_point now = clock_type::now();
+		double elapsed = std::chrono::duration<double>(now - m_last).count();
+		m_tokens = std::min(m_tokens + elapsed * m_rate, m_rate * burst_seconds) - static_cast<double>(n);
+		m_last = now;
+
+		if (m_tokens >= 0)
+			return clock_type::duration::zero();
+		return std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(-m_tokens / m_rate));
+	}
+};
+
+
+struct ProcessLimits {
+	TokenBucket bytes;
+	TokenBucket ops;
+	std::atomic_bool enabled{};
+};
+
+ProcessLimits &process_limits()
+{
+	static ProcessLimits limits;
+	return limits;
+}
+
+
+// Delays reads to stay within the stream and process limits.
+class ThrottleIOStream : public IOStream {
+	std::unique_ptr<IOStream> m_io;
+	TokenBucket m_bytes;
+	TokenBucket m_ops;
+	bool m_process;
+
+	std::atomic<uint64_t> m_throttled_reads{};
+	std::atomic<uint64_t> m_throttle_delay_us{};
+
+	void throttle(uint64_t bytes, uint64_t ops)
+	{
+		clock_type::duration wait = std::max(m_bytes.reserve(bytes), m_ops.reserve(ops));
+
+		if (m_process && process_limits().enabled.load(std::memory_order_relaxed)) {
+			ProcessLimits &limits = process_limits();
+			wait = std::max({ wait, limits.bytes.reserve(bytes), limits.ops.reserve(ops) });
+		}
+
+		if (wait <= clock_type::duration::zero())
+			return;
+
+		++m_throttled_reads;
+		m_throttle_delay_us += std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+		std::this_thread::sleep_for(wait);
+	}
+public:
+	ThrottleIOStream(std::unique_ptr<IOStream> io, uint64_t bytes_per_sec, unsigned iops, bool process) :
+		m_io{ std::move(io) },
+		m_process{ process }
+	{
+		m_bytes.set_rate(bytes_per_sec);
+		m_ops.set_rate(iops);
+	}
+
+	bool seekable() const override { return m_io->seekable(); }
+
+	void read(void *buf, size_t n) override
+	{
+		throttle(n, 1);
+		m_io->read(buf, n);
+	}
+
+	void seek(int64_t offset, int whence) override { m_io->seek(offset, whence); }
+
+	uint64_t tell() const override { return m_io->tell(); }
+
+	uint64_t length() const override { return m_io->length(); }
+
+	void refresh() override { m_io->refresh(); }
+
+	const void *data() const noexcept override { return m_io->data(); }
+
+	rawz_stream_stats stats() const noexcept override
+	{
+		rawz_stream_stats stats = m_io->stats();
+		stats.throttled_reads += m_throttled_reads;
+		stats.throttle_delay_us += m_throttle_delay_us;
+		return stats;
+	}
+
+	void advise(uint64_t offset, uint64_t n, Advice advice) noexcept override { m_io->advise(offset, n, advice); }
+
+	bool is_hole(uint64_t offset, uint64_t n) noexcept override { return m_io->is_hole(offset, n); }
+
+	void release() noexcept override { m_io->release(); }
+
+	void read_batch(const IORequest *req, size_t count) override
+	{
+		uint64_t bytes = 0;
+		for (size_t i = 0; i < count; ++i) {
+			bytes += req[i].n;
+		}
+
+		throttle(bytes, count);
+		m_io->read_batch(req, count);
+	}
+};
+
+} // namespace
+
+
+std::unique_ptr<IOStream> create_throttle_stream(std::unique_ptr<IOStream> io, uint64_t bytes_per_sec, unsigned iops, bool process)
+{
+	return std::make_unique<ThrottleIOStream>(std::move(io), bytes_per_sec, iops, process);
+}
+
+void set_process_limits(uint64_t bytes_per_sec, unsigned iops)
+{
+	ProcessLimits &limits = process_limits();
+	limits.bytes.set_rate(bytes_per_sec);
+	limits.ops.set_rate(iops);
+	limits.enabled = bytes_per_sec || iops;
+}
+
+bool process_limits_enabled() noexcept
+{
+	return process_limits().enabled;
+}
+
+} // namespace rawz
@@ -12,6 +12,7 @@
 #include <string_view>
 #include <system_error>
 #include <utility>
+#include <vector>
 #include "io.h"
 #include "stream.h"
 
@@ -85,7 +86,6 @@ class Y4MStream : public VideoStream {
 	rawz_metadata m_metadata;
 	uint64_t m_offset;
 	uint64_t m_packet_size;
-	int64_t m_frameno;
 
 	template <size_t N>
 	static constexpr std::string_view to_sv(const std::array<char, N> &arr)
@@ -110,7 +110,7 @@ class Y4MStream : public VideoStream {
 			m_metadata.chromaloc = chromaloc;
 		};
 
-		if ("420jpeg") {
+		if (str == "420jpeg") {
 			set420special(CHROMA_CENTER);
 			return;
 		} else if (str == "420mpeg2") {
@@ -309,10 +309,10 @@ class Y4MStream : public VideoStream {
 public:
 	explicit Y4MStream(std::unique_ptr<IOStream> io) :
 		m_io{ std::move(io) },
+		m_format{},
 		m_metadata(default_metadata()),
 		m_offset{},
-		m_packet_size{},
-		m_frameno{ -1 }
+		m_packet_size{}
 	{
 		if (m_io->seekable())
 			m_io->seek(0, IOStream::seek_set);
@@ -324,7 +324,6 @@ public:
 
 		m_offset = m_io->tell();
 		m_packet_size = s_frame_magic.size() + planar_frame_size(m_format);
-		m_frameno = 0;
 	}
 
 	int64_t framecount() const noexcept override
@@ -337,22 +336,47 @@ public:
 
 	rawz_metadata metadata() const noexcept override { return m_metadata; }
 
-	void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4]) override try
-	{
-		seek_to_frame(m_io.get(), m_frameno, n, m_packet_size, m_offset);
+	rawz_stream_stats stats() const noexcept override { return m_io->stats(); }
+
+	uint64_t packet_offset(int64_t n) const override { return frame_offset(n, m_packet_size, m_offset); }
 
+	uint64_t packet_size() const noexcept override { return m_packet_size; }
+
+	void read(int64_t n, void * const planes[4], const ptrdiff_t stride[4], rawz_frame_info * /*info*/) override
+	{
+		uint64_t offset = packet_offset(n);
 		std::array<char, s_frame_magic.size()> header{};
-		m_io->read(header);
+
+		// The frame header is read together with the planes.
+		std::vector<IORequest> req;
+		req.push_back({ offset, header.data(), header.size() });
+		planar_frame_requests(req, offset + header.size(), m_format, planes, stride);
+		m_io->read_batch(req.data(), req.size());
+
 		if (to_sv(header) == s_frame_magic_bad)
 			throw std::runtime_error{ "Y4M frame properties not supported" };
 		if (to_sv(header) != s_frame_magic)
 			throw std::runtime_error{ "missing Y4M frame header" };
+	}
+
+	bool map(int64_t n, const void *planes[4], ptrdiff_t stride[4]) override
+	{
+		const char *data = static_cast<const char *>(m_io->data());
+		if (!data)
+			return false;
+		if (n < 0 || n >= framecount())
+			throw IOStream::eof{};
+
+		data += packet_offset(n);
+
+		std::string_view header{ data, s_frame_magic.size() };
+		if (header == s_frame_magic_bad)
+			throw std::runtime_error{ "Y4M frame properties not supported" };
+		if (header != s_frame_magic)
+			throw std::runtime_error{ "missing Y4M frame header" };
 
-		blit_planar_frame(m_io.get(), m_format, planes, stride);
-		++m_frameno;
-	} catch (...) {
-		m_frameno = -1;
-		throw;
+		map_planar_frame(data + s_frame_magic.size(), m_format, planes, stride);
+		return true;
 	}
 
 	const rawz_format &format() const { return m_format; }
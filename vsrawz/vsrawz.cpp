@@ -2,10 +2,12 @@
 #include <cctype>
 #include <climits>
 #include <cstdint>
+#include <filesystem>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 #include "rawz.h"
 #include "VSConstants4.h"
 #include "VSHelper4.h"
@@ -47,6 +49,23 @@ int check_uint(unsigned x)
 	return x;
 }
 
+// Lowercase extension including the dot, or an empty string.
+std::string file_extension(std::string_view path)
+{
+	size_t idx = path.rfind('.');
+	std::string ext = idx == std::string::npos ? ""s : std::string(path.substr(idx));
+	std::transform(ext.begin(), ext.end(), ext.begin(), static_cast<int(*)(int)>(std::tolower));
+	return ext;
+}
+
+// Pipes and devices such as /dev/stdin can only be read sequentially.
+bool is_sequential_file(const std::string &path)
+{
+	std::error_code ec;
+	std::filesystem::file_status status = std::filesystem::status(std::filesystem::u8path(path), ec);
+	return !ec && (std::filesystem::is_fifo(status) || std::filesystem::is_character_file(status));
+}
+
 std::pair<int64_t, int64_t> normalize_rational(int64_t num, int64_t den)
 {
 	vsh::reduceRational(&num, &den);
@@ -69,6 +88,13 @@ const std::unordered_map<std::string_view, rawz_packing_mode> g_packing_mode_tab
 	{ "v210",  RAWZ_V210 },
 };
 
+const std::unordered_map<std::string_view, rawz_io_mode> g_io_mode_table{
+	{ "stdio",  RAWZ_IO_STDIO },
+	{ "mmap",   RAWZ_IO_MMAP },
+	{ "direct", RAWZ_IO_DIRECT },
+	{ "async",  RAWZ_IO_ASYNC },
+};
+
 } // namespace
 
 
@@ -83,6 +109,8 @@ class SourceFilter : public FilterBase {
 	Frame m_prop_holder;
 	VSVideoInfo m_vi;
 	bool m_alpha;
+	bool m_sparse;
+	std::vector<std::string> m_field_names; // Frame properties for the packet header fields.
 
 	void init_format(const rawz_format &formatz, bool rgb, const Core &core)
 	{
@@ -170,24 +198,33 @@ class SourceFilter : public FilterBase {
 			props.set_prop("_ChromaLocation", metadata.chromaloc);
 	}
 public:
-	SourceFilter(void * = nullptr) : m_vi(), m_alpha{} {}
+	SourceFilter(void * = nullptr) : m_vi(), m_alpha{}, m_sparse{} {}
 
 	const char *get_name(void *) noexcept override { return "Source"; }
 
 	void init(const ConstMap &in, const Map &out, const Core &core) override
 	{
-		std::string_view path = in.get_prop<std::string_view>("source");
+		// Multiple sources are read as one file, in order.
+		std::vector<std::string> paths;
+		for (int i = 0; i < in.num_elements("source"); ++i) {
+			paths.emplace_back(in.get_prop<std::string_view>("source", i));
+		}
+		std::string_view path = paths.front();
+
+		// Shared memory ring buffers written by a capture program are named "shm:<name>".
+		bool shm = paths.size() == 1 && path.substr(0, 4) == "shm:";
 		Y4MMode y4m_mode = static_cast<Y4MMode>(in.get_prop<int>("y4m", map::Ignore{}));
 		bool y4m = y4m_mode == Y4MMode::FORCE;
 
+		// Check for compressed file. The type is given by the previous extension, e.g. "clip.y4m.zst".
+		std::string ext = file_extension(path);
+		bool compressed = ext == ".zst" || ext == ".lz4";
+		if (compressed)
+			ext = file_extension(path.substr(0, path.size() - ext.size()));
+
 		// Check for Y4M file.
-		if (y4m_mode == Y4MMode::AUTO) {
-			size_t idx = path.rfind('.');
-			std::string ext = idx == std::string::npos ? ""s : std::string(path.substr(idx));
-			std::transform(ext.begin(), ext.end(), ext.begin(), static_cast<int(*)(int)>(std::tolower));
-			if (ext == ".y4m")
-				y4m = true;
-		}
+		if (y4m_mode == Y4MMode::AUTO && ext == ".y4m")
+			y4m = true;
 
 		rawz_format formatz;
 		bool rgb = false;
@@ -227,13 +264,123 @@ public:
 				throw std::runtime_error{ "too much alignment" };
 		}
 
+		rawz_io_options io_options;
+		rawz_io_options_default(&io_options);
+
+		if (in.contains("io")) {
+			std::string_view key = in.get_prop<std::string_view>("io");
+			auto it = g_io_mode_table.find(key);
+			if (it == g_io_mode_table.end())
+				throw std::runtime_error{ "unknown I/O mode: " + std::string{ key } };
+			io_options.mode = it->second;
+		}
+
+		int64_t iobuffer = in.get_prop<int64_t>("iobuffer", map::Ignore{});
+		if (iobuffer < 0 || static_cast<uint64_t>(iobuffer) > SIZE_MAX)
+			throw std::runtime_error{ "invalid I/O buffer size" };
+		io_options.buffer_size = static_cast<size_t>(iobuffer);
+
+		int64_t backseek = in.get_prop<int64_t>("backseek", map::Ignore{});
+		int64_t backseek_spill = in.get_prop<int64_t>("backseekspill", map::Ignore{});
+		if (backseek < 0 || static_cast<uint64_t>(backseek) > SIZE_MAX || backseek_spill < 0)
+			throw std::runtime_error{ "invalid backward seek window" };
+		io_options.backseek_bytes = static_cast<size_t>(backseek);
+		io_options.backseek_spill_bytes = static_cast<uint64_t>(backseek_spill);
+
+		io_options.compressed = compressed;
+		io_options.follow = in.get_prop<bool>("follow", map::Ignore{});
+		io_options.follow_timeout = int64_to_uint(in.get_prop<int64_t>("followtimeout", map::Ignore{}));
+
+		int64_t maxrate = in.get_prop<int64_t>("maxrate", map::Ignore{});
+		if (maxrate < 0)
+			throw std::runtime_error{ "invalid rate limit" };
+		io_options.max_bytes_per_sec = static_cast<uint64_t>(maxrate);
+		io_options.max_iops = int64_to_uint(in.get_prop<int64_t>("maxiops", map::Ignore{}));
+		io_options.scheduled = in.get_prop<bool>("schedule", map::Ignore{});
+		io_options.parallel_threads = int64_to_uint(in.get_prop<int64_t>("readthreads", map::Ignore{}));
+
+		int64_t rangesize = in.get_prop<int64_t>("rangesize", map::Ignore{});
+		if (rangesize < 0 || static_cast<uint64_t>(rangesize) > SIZE_MAX)
+			throw std::runtime_error{ "invalid range size" };
+		io_options.parallel_range_size = static_cast<size_t>(rangesize);
+
+		// The limit is shared by all lazy sources.
+		io_options.lazy_open = in.get_prop<bool>("lazy", map::Ignore{});
+		if (in.contains("maxopen"))
+			rawz_set_max_open_files(int64_to_uint(in.get_prop<int64_t>("maxopen")));
+
 		int64_t offset = in.get_prop<int64_t>("offset", map::Ignore{});
 		offset = std::max(offset, static_cast<int64_t>(0));
-		rawz_io_stream_ptr io{ rawz_io_open_file(path.data(), 1, offset) };
+		bool seekable = paths.size() > 1 || !is_sequential_file(paths.front());
+		rawz_io_stream_ptr io;
+		if (shm) {
+			io.reset(rawz_io_open_shm(paths.front().c_str() + 4, &io_options));
+		} else if (paths.size() > 1) {
+			std::vector<const char *> path_ptrs;
+			for (const std::string &segment : paths) {
+				path_ptrs.push_back(segment.c_str());
+			}
+			io.reset(rawz_io_open_segments(path_ptrs.data(), path_ptrs.size(), offset, &io_options));
+		} else {
+			io.reset(rawz_io_open_file2(paths.front().c_str(), seekable, offset, &io_options));
+		}
 		if (!io)
 			throw_rawz_exception();
 
-		m_stream.reset(rawz_video_stream_create(io.release(), &formatz));
+		rawz_stream_options stream_options;
+		rawz_stream_options_default(&stream_options);
+
+		int64_t prefetch = in.get_prop<int64_t>("prefetch", map::Ignore{});
+		int64_t prefetch_bytes = in.get_prop<int64_t>("prefetchbytes", map::Ignore{});
+		if (prefetch_bytes < 0 || static_cast<uint64_t>(prefetch_bytes) > SIZE_MAX)
+			throw std::runtime_error{ "invalid prefetch size" };
+		stream_options.prefetch_depth = int64_to_uint(prefetch);
+		stream_options.prefetch_bytes = static_cast<size_t>(prefetch_bytes);
+		stream_options.drop_behind = in.get_prop<bool>("dropbehind", map::Ignore{});
+		stream_options.sparse = m_sparse = in.get_prop<bool>("sparse", map::Ignore{});
+		stream_options.willneed_depth = int64_to_uint(in.get_prop<int64_t>("willneed", map::Ignore{}));
+
+		int64_t cache_size = in.get_prop<int64_t>("cachesize", map::Ignore{});
+		if (cache_size < 0 || static_cast<uint64_t>(cache_size) > SIZE_MAX)
+			throw std::runtime_error{ "invalid cache size" };
+		stream_options.cache_bytes = static_cast<size_t>(cache_size);
+
+		std::string offsets_path;
+		if (in.contains("offsets")) {
+			offsets_path = in.get_prop<std::string_view>("offsets");
+			stream_options.frame_offsets_path = offsets_path.c_str();
+		}
+
+		int64_t prefix = in.get_prop<int64_t>("prefix", map::Ignore{});
+		int64_t suffix = in.get_prop<int64_t>("suffix", map::Ignore{});
+		if (prefix < 0 || static_cast<uint64_t>(prefix) > SIZE_MAX || suffix < 0 || static_cast<uint64_t>(suffix) > SIZE_MAX)
+			throw std::runtime_error{ "invalid packet prefix or suffix" };
+		stream_options.packet_prefix = static_cast<size_t>(prefix);
+		stream_options.packet_suffix = static_cast<size_t>(suffix);
+
+		// Missing arrays have -1 elements.
+		int field_count = std::max(in.num_elements("fieldnames"), 0);
+		if (field_count > RAWZ_MAX_HEADER_FIELDS)
+			throw std::runtime_error{ "too many header fields" };
+		if (std::max(in.num_elements("fieldoffsets"), 0) != field_count || std::max(in.num_elements("fieldsizes"), 0) != field_count)
+			throw std::runtime_error{ "fieldnames, fieldoffsets and fieldsizes must have the same length" };
+
+		for (int i = 0; i < field_count; ++i) {
+			rawz_header_field &field = stream_options.header_fields[i];
+			field.offset = int64_to_uint(in.get_prop<int64_t>("fieldoffsets", i));
+			field.size = int64_to_uint(in.get_prop<int64_t>("fieldsizes", i));
+			field.big_endian = in.get_prop<bool>("bigendian", map::Ignore{});
+			m_field_names.emplace_back(in.get_prop<std::string_view>("fieldnames", i));
+		}
+		stream_options.header_field_count = field_count;
+
+		// The frame count of a growing file is an upper bound. Otherwise, it is determined by the file length.
+		if (!seekable || shm || io_options.follow)
+			stream_options.framecount = in.get_prop<int64_t>("framecount", map::Ignore{});
+		if ((!seekable || shm) && stream_options.framecount <= 0)
+			throw std::runtime_error{ "framecount required for pipes and shared memory" };
+
+		m_stream.reset(rawz_video_stream_create2(io.release(), &formatz, &stream_options));
 		if (!m_stream)
 			throw_rawz_exception();
 
@@ -255,11 +402,14 @@ public:
 		}
 		init_metadata(metadata, core);
 
-		create_video_filter(out, m_vi, fmUnordered, make_deps(), core);
+		// Every io mode serves positional reads concurrently (direct streams stage per call, io_uring submissions are not
+		// serialized), so frames are read and unpacked in parallel. Pipes are read in request order.
+		create_video_filter(out, m_vi, seekable ? fmParallel : fmUnordered, make_deps(), core);
 	}
 
 	ConstFrame get_frame_initial(int n, const Core &core, const FrameContext &frame_context, void *) override
 	{
+		// Requests are served as they arrive, so the read-ahead of the stream sees them in request order.
 		return get_frame(n, core, frame_context, nullptr);
 	}
 
@@ -283,10 +433,18 @@ public:
 			stride[3] = alpha.stride(0);
 		}
 
-		if (rawz_video_stream_read(m_stream.get(), n, planes, stride))
+		rawz_frame_info info{};
+		if (rawz_video_stream_read_info(m_stream.get(), n, planes, stride, &info))
 			throw_rawz_exception();
 		if (alpha)
 			frame.frame_props_rw().set_prop("_Alpha", std::move(alpha));
+		if (m_sparse)
+			frame.frame_props_rw().set_prop("RawzSparse", static_cast<int>(info.sparse));
+
+		// Sparse frames have no header.
+		for (size_t i = 0; i < m_field_names.size() && !info.sparse; ++i) {
+			frame.frame_props_rw().set_prop(m_field_names[i].c_str(), static_cast<int64_t>(info.header_fields[i]));
+		}
 
 		return frame;
 	}
@@ -296,9 +454,15 @@ public:
 const PluginInfo4 g_plugin_info4 = {
 	"who.you.gonna.call.when.they.come.for.you", "rawz", "VapourSynth Raw Source", 0, {
 		{ &FilterBase::filter_create<SourceFilter>, "Source",
-			"source:data;width:int:opt;height:int:opt;format:int:opt;"
+			"source:data[];width:int:opt;height:int:opt;format:int:opt;"
 				"packing:data:opt;offset:int:opt;alignment:int:opt;y4m:int:opt;alpha:int:opt;"
-				"fpsnum:int:opt;fpsden:int:opt;sarnum:int:opt;sarden:int:opt;",
+				"fpsnum:int:opt;fpsden:int:opt;sarnum:int:opt;sarden:int:opt;"
+				"io:data:opt;iobuffer:int:opt;prefetch:int:opt;prefetchbytes:int:opt;"
+				"dropbehind:int:opt;willneed:int:opt;cachesize:int:opt;"
+				"framecount:int:opt;backseek:int:opt;backseekspill:int:opt;follow:int:opt;followtimeout:int:opt;"
+				"sparse:int:opt;maxrate:int:opt;maxiops:int:opt;schedule:int:opt;readthreads:int:opt;rangesize:int:opt;"
+				"lazy:int:opt;maxopen:int:opt;offsets:data:opt;prefix:int:opt;suffix:int:opt;"
+				"fieldnames:data[]:opt;fieldoffsets:int[]:opt;fieldsizes:int[]:opt;bigendian:int:opt;",
 			"clip:vnode;" }
 	}
 };